@@ -30,10 +30,98 @@
 //			Next lower is Entropy, then Otsu. All methods work and can be tested.
 //			Gradient method seems most reliable.
 //
+//		Method
+//			Auto threshold method - Gradient (0), Entropy (0.5) or Otsu (1).
+//			Entropy and Otsu use a luminance histogram of the pixels
+//			read back and are not calculated by the GPU option.
+//
+//		Decimation
+//			The frame is reduced in size by 1, 2, 4 or 8 before it is read back
+//			for auto threshold. Higher values are faster but less accurate.
+//
+//		GPU
+//			The gradient for auto threshold is calculated by the GPU
+//			and used by the shader in the same frame. Nothing is read back.
+//			Damping applies but Interval and Incremental do not.
+//
+//		Async
+//			The auto threshold is calculated by a background thread
+//			so that rendering is not held up. Frames that arrive while
+//			it is busy are not used and the last result is kept.
+//			Off by default because the threshold then lags a frame or more.
+//
+//		Interval
+//			The auto threshold is estimated every 1 to 16 frames.
+//			Nothing is read back on the frames between. A change of
+//			scene seen by a small probe of the frame forces an estimate.
+//
+//		Damping
+//			Estimates are averaged over time so that the threshold does
+//			not jitter with noisy input. Small changes are ignored.
+//			A change of scene is followed immediately.
+//
+//		Incremental
+//			Statistics are only counted again for parts of the frame
+//			that have changed. Faster for mostly static sources.
+//
+//		Luma
+//			The frame is read back as one byte of luminance per pixel
+//			instead of four bytes of RGBA, a quarter of the transfer.
+//			The gradient is then of luminance rather than the RGB sum.
+//
+//		Profile
+//			Times of the stages of each frame are written every 120 frames
+//			to AutoThreshold.log in the temporary folder. CPU times of the
+//			draw, readback, map, copy and estimate and GPU times of the draw
+//			and readback, as minimum, average and 99th percentile.
+//
+//		Budget
+//			Milliseconds of each frame, up to 10, that the auto threshold
+//			readback and estimate may take on average. When it costs more the
+//			sampling stride, then the decimation and then the interval are
+//			doubled in steps. They return to the settings when the cost has
+//			fallen well below the budget. Zero for no budget.
+//
+//		Instances
+//			Shaders are compiled once for each GL context. Instances with
+//			the same input texture and auto threshold settings share the
+//			estimates of the first of them, so that a frame is only read
+//			back once. Each keeps its own Damping and user threshold.
+//
+//		ROI X, ROI Y, ROI Width, ROI Height
+//			Region of the frame used for auto threshold, from the top left.
+//			Only the region is read back and estimated so the cost goes
+//			with its area. The GPU option and the scene probe use the
+//			whole frame.
+//
+//		Mask
+//			An optional second input. Its luminance weights the auto threshold
+//			so that black areas, such as burned-in overlays, are left out.
+//			The frame is then read back as RGBA with the mask in alpha.
+//
+//		Adaptive
+//			Each tile of an 8 x 8 grid gets its own auto threshold so that
+//			unevenly lit scenes still separate. The gradient of each tile is
+//			made by the GPU as for the GPU option and the grid is blended
+//			smoothly across the frame. Tiles with little detail follow the
+//			threshold of the whole frame. Nothing is read back.
+//
+//		Local, Radius
+//			The threshold of each pixel is the mean luminance of the square
+//			around it, modified by the "Threshold" control. The mean is read
+//			from a summed area table made by the GPU at half size so the cost
+//			is the same for any Radius, up to 128 pixels. Nothing is read back.
+//
 //		Two tone
 //			The black and white areas are replaced with two colours.
 //			The RGBA of each can be adjusted with the parameter controls.
 //
+//		Levels
+//			Two tone is posterised to 2, 3 or 4 levels between the two colours.
+//			With auto threshold the levels are found by a multi level Otsu of
+//			the frame histogram, otherwise they are evenly spaced about the
+//			threshold. The "Threshold" control moves them all together.
+//
 //		Chroma
 //			The original image chroma is mixed back into the thresholded result.
 //			Alpha of the black is controlled by "Alpha 1"
@@ -43,6 +131,34 @@
 //		Revisions :
 //		12-01-15	Version 1.000
 //		10-03-16	Branch test
+//		14-10-26	Persistent PBO ring for auto threshold readback
+//					GPU reduction option for gradient auto threshold
+//					Decimated readback option
+//					SSE2 and AVX2 gradient kernels
+//					Estimators split into bands for a shared worker pool
+//					Async option for background auto threshold
+//					Method selection for Gradient, Entropy and Otsu
+//					Single pass entropy split
+//					32 bit sampled luminance histogram
+//					Levels and percentiles in the frame statistics
+//					Interval and Damping with scene change probe
+//					Incremental statistics of changed tiles
+//					Vertex buffer for the quad
+//					Shader program for each mode
+//					Colour uniforms packed and only loaded when changed
+//					GPU option keeps the auto threshold on the GPU
+//					Rectangle textures and luminance readback
+//					Profile option with CPU and GPU stage times
+//					Estimators moved to ThresholdStats with an offline benchmark
+//					Shaders and auto threshold shared between instances
+//					Region of interest and mask input for auto threshold
+//					Adaptive tiled threshold made by the GPU
+//					Local mean threshold from a summed area table
+//					Otsu on integer prefix sums and posterised two tone levels
+//					Parameters held in a seqlock block and read once a frame
+//					Lookup table for B&W and two tone with a uniform threshold
+//					Batch tool for recorded frames outside a host
+//					Budget for the auto threshold cost of each frame
 //
 //		------------------------------------------------------------
 //
@@ -66,28 +182,70 @@
 #include <FFGL.h>
 #include <FFGLLib.h>
 #include <stdio.h>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <malloc.h> // for _aligned_malloc
 
 #include "AutoThreshold.h"
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
-#define FFPARAM_Threshold  (0)
-#define FFPARAM_Smoothness (1)
-#define FFPARAM_Auto       (2)
-#define FFPARAM_TwoTone    (3)
-#define FFPARAM_Chroma     (4)
-#define FFPARAM_Red1       (5)
-#define FFPARAM_Grn1       (6)
-#define FFPARAM_Blu1       (7)
-#define FFPARAM_Alf1       (8)
-#define FFPARAM_Red2       (9)
-#define FFPARAM_Grn2       (10)
-#define FFPARAM_Blu2       (11)
-#define FFPARAM_Alf2       (12)
+#define FFPARAM_Threshold   (0)
+#define FFPARAM_Smoothness  (1)
+#define FFPARAM_Auto        (2)
+#define FFPARAM_TwoTone     (3)
+#define FFPARAM_Chroma      (4)
+#define FFPARAM_Red1        (5)
+#define FFPARAM_Grn1        (6)
+#define FFPARAM_Blu1        (7)
+#define FFPARAM_Alf1        (8)
+#define FFPARAM_Red2        (9)
+#define FFPARAM_Grn2        (10)
+#define FFPARAM_Blu2        (11)
+#define FFPARAM_Alf2        (12)
+#define FFPARAM_Method      (13)
+#define FFPARAM_Decimation  (14)
+#define FFPARAM_Gpu         (15)
+#define FFPARAM_Async       (16)
+#define FFPARAM_Interval    (17)
+#define FFPARAM_Damping     (18)
+#define FFPARAM_Incremental (19)
+#define FFPARAM_Luma        (20)
+#define FFPARAM_Profile     (21)
+#define FFPARAM_Budget      (22)
+#define FFPARAM_RoiX        (23)
+#define FFPARAM_RoiY        (24)
+#define FFPARAM_RoiWidth    (25)
+#define FFPARAM_RoiHeight   (26)
+#define FFPARAM_Adaptive    (27)
+#define FFPARAM_Local       (28)
+#define FFPARAM_Radius      (29)
+#define FFPARAM_Levels      (30)
+// Parameters after Alf2 are added at the end so that the
+// numbers saved by hosts stay the same
+// NUM_PARAMS in AutoThreshold.h is one more than the last
 
 #define STRINGIFY(A) #A
 
+// Names of the stages in the profile log
+static const char *s_profileNames[NUM_PROFILE] = {
+	"Draw", "Readback", "Map", "Copy", "Estimate", "GPU draw", "GPU read"
+};
+
+// Stride, decimation and interval multipliers of each budget level
+static const int s_budgetLevels[NUM_BUDGET_LEVELS][3] = {
+	{ 1, 1, 1 }, { 2, 1, 1 }, { 2, 2, 1 }, { 2, 2, 2 }, { 4, 2, 2 }, { 4, 4, 2 }, { 4, 4, 4 }
+};
+
+// Set when a shader error has been shown by any instance
+static std::atomic<bool> s_shaderErrorShown(false);
+
+static double ProfileClock();
+static FILE *OpenProfileLog();
+static void CloseProfileLog();
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //  Plugin information
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -116,27 +274,39 @@ void main()
 
 
 // 2 toner threshold
+// Compiled once for each mode with "#define MODE n" in front,
+// 0 for B&W, 1 for two tone and 2 for chroma. MODE is a constant
+// so each program keeps only the code for its own mode.
+// With "#define AUTO 1" the auto threshold is read from the 1x1
+// texture made by the GPU in the same frame and Threshold is the
+// user setting that modifies it. With "#define AUTO 2" it is read
+// from the tile grid of the adaptive mode, filtered between tiles.
+// With "#define AUTO 3" it is the mean of the square around the pixel
+// from the summed area table of the local mode.
+// With "#define AUTO 0" the B&W and two tone results depend only
+// on luminance and are read from the lookup table made by UpdateLut.
+// SAMPLER and TEXTURE are defined for the input texture target
+// by TargetSource.
 char *fragmentShaderCode = STRINGIFY (
-uniform sampler2D tex1;
+uniform SAMPLER tex1;
+uniform sampler2D ThresholdTex;
 uniform float Threshold;
 uniform float Smoothness;
-uniform int TwoTone;
-uniform int Chroma;
-uniform float Red1;
-uniform float Grn1;
-uniform float Blu1;
-uniform float Red2;
-uniform float Grn2;
-uniform float Blu2;
-uniform float Alf1;
-uniform float Alf2;
+uniform vec4 Color1; // RGBA 1
+uniform vec4 Color2; // RGBA 2
+uniform vec2 TexScale; // input texture coordinates to 0-1 for the tile grid
+uniform vec2 SatSize; // summed area table size in texels
+uniform float Radius; // half size of the square in table texels
+uniform float Levels; // posterised two tone levels, 2 for none
+uniform vec3 LevelScale; // level thresholds as multiples of the threshold
 const vec4 grayScaleWeights = vec4(0.30, 0.59, 0.11, 0.0);
 
-float minChannel(in vec3 v)
+// Summed area table, 0 to the left of and below the first texel
+float sat(in float x, in float y)
 {
-  float t = (v.x<v.y) ? v.x : v.y;
-  t = (t<v.z) ? t : v.z;
-  return t;
+	if(x < 0.0 || y < 0.0)
+		return 0.0;
+	return texture2D(ThresholdTex, (vec2(x, y) + 0.5)/SatSize).r;
 }
 
 float maxChannel(in vec3 v)
@@ -146,90 +316,63 @@ float maxChannel(in vec3 v)
   return t;
 }
 
-vec3 rgbToHsv(in vec3 rgb)
-{
-  vec3  hsv = vec3(0.0);
-  float minVal = minChannel(rgb);
-  float maxVal = maxChannel(rgb);
-  float delta = maxVal - minVal;
-
-  hsv.z = maxVal;
-
-  if (delta != 0.0) {
-    hsv.y = delta / maxVal;
-    vec3 delRGB;
-    delRGB = (((vec3(maxVal) - rgb) / 6.0) + (delta/2.0)) / delta;
-
-    if (rgb.x == maxVal) {
-      hsv.x = delRGB.z - delRGB.y;
-    } else if (rgb.y == maxVal) {
-      hsv.x = ( 1.0/3.0) + delRGB.x - delRGB.z;
-    } else if (rgb.z == maxVal) {
-      hsv.x = ( 2.0/3.0) + delRGB.y - delRGB.x;
-    }
-
-    if ( hsv.x < 0.0 ) { 
-      hsv.x += 1.0; 
-    }
-    if ( hsv.x > 1.0 ) { 
-      hsv.x -= 1.0; 
-    }
-  }
-  return hsv;
-}
-
-vec3 hsvToRgb(in vec3 hsv)
-{
-  vec3 rgb = vec3(hsv.z);
-  if ( hsv.y != 0.0 ) {
-    float var_h = hsv.x * 6.0;
-    float var_i = floor(var_h);   // Or ... var_i = floor( var_h )
-    float var_1 = hsv.z * (1.0 - hsv.y);
-    float var_2 = hsv.z * (1.0 - hsv.y * (var_h-var_i));
-    float var_3 = hsv.z * (1.0 - hsv.y * (1.0 - (var_h-var_i)));
-
-    switch (int(var_i)) {
-      case  0: rgb = vec3(hsv.z, var_3, var_1); break;
-      case  1: rgb = vec3(var_2, hsv.z, var_1); break;
-      case  2: rgb = vec3(var_1, hsv.z, var_3); break;
-      case  3: rgb = vec3(var_1, var_2, hsv.z); break;
-      case  4: rgb = vec3(var_3, var_1, hsv.z); break;
-      default: rgb = vec3(hsv.z, var_1, var_2); break;
-    }
-  }
-  return rgb;
-}
-
 void main (void) {
 
-	vec4 c1 = vec4(Red1, Grn1, Blu1, Alf1);
-	vec4 c2 = vec4(Red2, Grn2, Blu2, Alf2);
-
 	 // lookup input color
 	vec2 texCoord = gl_TexCoord[0].st;
-	vec4 c0 = texture2D(tex1, texCoord);
-
-	// Convert to HSV for combining chroma
-	vec3 hsv = rgbToHsv(vec3(c0.r, c0.g, c0.b));
+	vec4 c0 = TEXTURE(tex1, texCoord);
 
 	// calculate luminance
 	float luminance = dot(c0, grayScaleWeights);
+
+	// One fetch between the table entries
+	if(AUTO == 0 && MODE < 2) {
+		gl_FragColor = texture2D(ThresholdTex, vec2((luminance*(LUT_SIZE - 1.0) + 0.5)/LUT_SIZE, 0.5));
+		return;
+	}
+
+	float threshold = Threshold;
+	if(AUTO == 1)
+		threshold = clamp(texture2D(ThresholdTex, vec2(0.5)).r*Threshold*2.0, 0.0, 1.0);
+	else if(AUTO == 2)
+		threshold = clamp(texture2D(ThresholdTex, texCoord*TexScale).r*Threshold*2.0, 0.0, 1.0);
+	else if(AUTO == 3) {
+		// Four reads for any size of square
+		// The table holds luminance - 0.5 for precision
+		vec2 p  = floor(texCoord*TexScale*SatSize);
+		vec2 lo = max(p - Radius - 1.0, vec2(-1.0));
+		vec2 hi = min(p + Radius, SatSize - 1.0);
+		float sum = sat(hi.x, hi.y) - sat(lo.x, hi.y) - sat(hi.x, lo.y) + sat(lo.x, lo.y);
+		float mean = sum/((hi.x - lo.x)*(hi.y - lo.y)) + 0.5;
+		threshold = clamp(mean*Threshold*2.0, 0.0, 1.0);
+	}
 	
 	// Threshold with smoothing
-	float f = smoothstep(Threshold, Threshold+Smoothness, luminance);
+	float f = smoothstep(threshold, threshold+Smoothness, luminance);
 
 	// Alpha for thresholded result
 	//   - black is alpha1
 	//   - white is alpha2
-	float alf = Alf1;
-	if(f > 0.5) alf = Alf2;
-
-	if(TwoTone > 0 && Chroma <= 0)	{ // 2-tone
-		gl_FragColor = f*c1 + (1.0-f)*c2;
+	float alf = Color1.a;
+	if(f > 0.5) alf = Color2.a;
+
+	if(MODE == 1) { // 2-tone
+		if(Levels > 2.0) {
+			// Posterised, f is the part of the level thresholds passed
+			vec3 t = clamp(threshold*LevelScale, 0.0, 1.0);
+			f = smoothstep(t.x, t.x+Smoothness, luminance) + smoothstep(t.y, t.y+Smoothness, luminance);
+			if(Levels > 3.0)
+				f += smoothstep(t.z, t.z+Smoothness, luminance);
+			f /= Levels - 1.0;
+		}
+		gl_FragColor = f*Color1 + (1.0-f)*Color2;
 	}
-	else if(Chroma > 0 && TwoTone <= 0) { // chroma
-		// Now we have luminance so convert back from HSV to RGB
-		vec3 c = hsvToRgb(vec3(hsv.x, hsv.y, f));
+	else if(MODE == 2) { // chroma
+		// The HSV value replaced by the threshold keeps hue and
+		// saturation, which is the same as scaling by f/max(rgb)
+		float maxVal = maxChannel(c0.rgb);
+		vec3 c = vec3(f);
+		if(maxVal > 0.0) c = c0.rgb*(f/maxVal);
 		gl_FragColor = vec4(c, alf);
 	}
 	else { // B&W
@@ -239,6 +382,155 @@ void main (void) {
 } );
 
 
+// Copy of the input for decimated readback
+char *copyShaderCode = STRINGIFY (
+uniform SAMPLER tex1;
+void main (void) {
+	gl_FragColor = TEXTURE(tex1, gl_TexCoord[0].st);
+} );
+
+
+// Luminance of the input for single channel readback
+// Only the red channel is read back
+char *lumaShaderCode = STRINGIFY (
+uniform SAMPLER tex1;
+const vec4 grayScaleWeights = vec4(0.30, 0.59, 0.11, 0.0);
+void main (void) {
+	gl_FragColor = vec4(dot(TEXTURE(tex1, gl_TexCoord[0].st), grayScaleWeights));
+} );
+
+
+// Copy of the input with the luminance of the mask in alpha
+// MASK_SAMPLER and MASK_TEXTURE are defined for the mask target
+// and MaskScale takes the input texture coordinates to the mask.
+char *maskShaderCode = STRINGIFY (
+uniform SAMPLER tex1;
+uniform MASK_SAMPLER MaskTex;
+uniform vec2 MaskScale;
+const vec4 grayScaleWeights = vec4(0.30, 0.59, 0.11, 0.0);
+void main (void) {
+	vec2 texCoord = gl_TexCoord[0].st;
+	float mask = dot(MASK_TEXTURE(MaskTex, texCoord*MaskScale), grayScaleWeights);
+	gl_FragColor = vec4(TEXTURE(tex1, texCoord).rgb, mask);
+} );
+
+
+// Gradient reduction for auto threshold
+// Each output pixel is one sample of the CPU gradient method.
+// Values are RGB sums (0-765) to match the CPU calculation.
+// The mipmap chain of the output then averages the samples.
+char *reduceShaderCode = STRINGIFY (
+uniform SAMPLER tex1;
+uniform vec2 Texel;
+const vec3 rgbSum = vec3(255.0, 255.0, 255.0);
+
+void main (void) {
+
+	vec2 texCoord = gl_TexCoord[0].st;
+
+	float left  = dot(TEXTURE(tex1, texCoord - vec2(Texel.x, 0.0)).rgb, rgbSum);
+	float right = dot(TEXTURE(tex1, texCoord + vec2(Texel.x, 0.0)).rgb, rgbSum);
+	float top   = dot(TEXTURE(tex1, texCoord - vec2(0.0, Texel.y)).rgb, rgbSum);
+	float bot   = dot(TEXTURE(tex1, texCoord + vec2(0.0, Texel.y)).rgb, rgbSum);
+	float mid   = dot(TEXTURE(tex1, texCoord).rgb, rgbSum);
+
+	// variance of neighbourhood
+	float exy = max(abs(left - right), abs(top - bot));
+
+	gl_FragColor = vec4(exy, exy*mid, 0.0, 1.0);
+
+} );
+
+// Auto threshold from the reduction for the GPU option
+// Drawn into a single pixel so the whole texture is under it and
+// with the large bias the 1x1 level of the mipmap chain is used.
+// The result is mixed with the last one for damping.
+char *resolveShaderCode = STRINGIFY (
+uniform sampler2D tex1;
+uniform sampler2D LastTex;
+uniform float Count;
+uniform float Damping;
+
+void main (void) {
+
+	vec4 s = texture2D(tex1, gl_TexCoord[0].st, 20.0);
+
+	// Averages back to sums as for the CPU method
+	float t = floor(s.g*Count/(s.r*Count + 1.0))/768.0;
+
+	float last = texture2D(LastTex, vec2(0.5)).r;
+	gl_FragColor = vec4(mix(t, last, Damping));
+
+} );
+
+// Threshold for each tile of the adaptive mode
+// Drawn into a Grid x Grid texture. The reduction texture is sampled
+// 4 x 4 times over each tile, two mip levels below the one that has
+// a texel for each tile. Tiles with less gradient than half of the
+// frame average lean towards the threshold of the whole frame.
+char *tileShaderCode = STRINGIFY (
+uniform sampler2D tex1;
+uniform sampler2D LastTex;
+uniform vec2 Grid;
+uniform float Damping;
+
+void main (void) {
+
+	vec2 tile = floor(gl_FragCoord.xy)/Grid;
+	vec4 s = vec4(0.0);
+	for(int i=0; i<4; i++) {
+		for(int j=0; j<4; j++)
+			s += texture2D(tex1, tile + (vec2(float(i), float(j)) + 0.5)/(Grid*4.0), -2.0);
+	}
+	s /= 16.0;
+
+	// The whole frame from the 1x1 level
+	vec4 f = texture2D(tex1, vec2(0.5), 20.0);
+	float frame = f.g/(f.r + 0.001)/768.0;
+	float local = s.g/(s.r + 0.001)/768.0;
+	float t = mix(frame, local, s.r/(s.r + 0.5*f.r + 0.001));
+
+	float last = texture2D(LastTex, gl_FragCoord.xy/Grid).r;
+	gl_FragColor = vec4(mix(t, last, Damping));
+
+} );
+
+// One pass of the summed area table of the local mode
+// Each texel adds the one Offset texels before it, so passes with
+// offsets of 1, 2, 4 ... make the prefix sums of the lines and then
+// of the columns. Bias is added to the luminance by the first pass.
+char *satShaderCode = STRINGIFY (
+uniform sampler2D tex1;
+uniform vec2 Offset;
+uniform vec2 Size;
+uniform float Bias;
+
+void main (void) {
+
+	vec2 p = floor(gl_FragCoord.xy);
+	vec2 q = p - Offset;
+	float s = texture2D(tex1, (p + 0.5)/Size).r + Bias;
+	if(q.x >= 0.0 && q.y >= 0.0)
+		s += texture2D(tex1, (q + 0.5)/Size).r + Bias;
+	gl_FragColor = vec4(s);
+
+} );
+
+// Definitions in front of the shaders that sample the input texture
+// Rectangle textures are sampled in pixels rather than 0-1
+// The prefix names the definitions for a second texture
+static std::string TargetSource(int target, const std::string &prefix = "")
+{
+	if(target == TARGET_RECT)
+		return "#extension GL_ARB_texture_rectangle : enable\n"
+			   "#define " + prefix + "SAMPLER sampler2DRect\n"
+			   "#define " + prefix + "TEXTURE texture2DRect\n";
+
+	return "#define " + prefix + "SAMPLER sampler2D\n"
+		   "#define " + prefix + "TEXTURE texture2D\n";
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 //  Constructor and destructor
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -246,20 +538,105 @@ void main (void) {
 AutoThreshold::AutoThreshold()
 :CFreeFrameGLPlugin(),
  m_initResources(1),
- m_thresholdLocation(-1),
- m_smoothnessLocation(-1),
- m_twotoneLocation(-1),
- m_ChromaLocation(-1),
- m_red1Location(-1),
- m_grn1Location(-1),
- m_blu1Location(-1),
- m_red2Location(-1),
- m_grn2Location(-1),
- m_blu2Location(-1),
- m_alf1Location(-1),
- m_alf2Location(-1)
+ m_quadVbo(0),
+ m_QuadS(-1.0f),
+ m_QuadT(-1.0f),
+ m_fbo(0),
+ m_PboIndex(0),
+ m_PboFrames(0),
+ m_PboWidth(0),
+ m_PboHeight(0),
+ m_PboBytes(4),
+ m_HostFBO(0),
+ m_passFbo(0),
+ m_MaskHandle(0),
+ m_MaskTarget(GL_TEXTURE_2D),
+ m_MaskScaleS(1.0f),
+ m_MaskScaleT(1.0f),
+ m_downTexture(0),
+ m_DownWidth(0),
+ m_DownHeight(0),
+ m_reduceTexture(0),
+ m_ReduceWidth(0),
+ m_ReduceHeight(0),
+ m_ReduceLevel(0),
+ m_ThresholdIndex(0),
+ m_TileIndex(0),
+ m_SatIndex(0),
+ m_SatWidth(0),
+ m_SatHeight(0),
+ m_lutTexture(0),
+ m_AutoThreshold(0.0f),
+ m_NewThreshold(0.0f),
+ m_NewFrame(0),
+ m_bNewThreshold(false),
+ m_ParamSequence(0),
+ m_FrameSequence(0),
+ m_NewLevels(0),
+ m_ScaleLevels(0),
+ m_FrameCount(0),
+ m_SceneFrames(0),
+ m_BudgetLevel(0),
+ m_BudgetFrames(0),
+ m_BudgetTime(0.0),
+ m_BudgetStride(1),
+ m_BudgetDecimation(1),
+ m_BudgetInterval(1),
+ m_WorkerTime(0.0f),
+ m_bEstimateOwner(false),
+ m_EstimateFrame(0),
+ m_SharedCount(0),
+ m_PublishCount(0),
+ m_SharedPublish(0),
+ m_probeTexture(0),
+ m_ProbeIndex(0),
+ m_ProbeFrames(0),
+ m_bProbeRef(false),
+ m_bProfile(false),
+ m_ProfileFrames(0),
+ m_profileFile(NULL),
+ m_workerBusy(false),
+ m_workerPending(false),
+ m_workerQuit(false),
+ m_workerStride(4),
+ m_workerMethod(METHOD_GRADIENT),
+ m_workerLevels(2),
+ m_workerIncremental(false),
+ m_workerFrame(0),
+ image(NULL),
+ m_ImageSize(0)
 {
 
+	for(int i=0; i<NUM_SHADERS; i++) {
+		m_UniformDirty[i] = UNIFORM_ALL;
+		m_UniformThreshold[i] = -1.0f;
+		memset((void *)m_UniformFrame[i], 0, sizeof(m_UniformFrame[i]));
+	}
+
+	for(int i=0; i<MAX_LEVELS-1; i++) {
+		m_NewLevelScale[i] = 0.0f;
+		m_LevelScale[i] = 0.0f;
+	}
+
+	for(int i=0; i<NUM_INPUTS; i++) {
+		m_InputHandle[i] = 0;
+		m_InputTarget[i] = GL_TEXTURE_2D;
+	}
+
+	memset((void *)&m_estimateKey, 0, sizeof(EstimateKey));
+	m_shared = NULL;
+
+	memset((void *)m_pbo, 0, NUM_PBOS*sizeof(GLuint));
+	memset((void *)m_probePbo, 0, NUM_PBOS*sizeof(GLuint));
+	memset((void *)m_queries, 0, sizeof(m_queries));
+	memset((void *)m_profile, 0, sizeof(m_profile));
+	m_thresholdTexture[0] = 0;
+	m_thresholdTexture[1] = 0;
+	m_tileTexture[0] = 0;
+	m_tileTexture[1] = 0;
+	m_satTexture[0] = 0;
+	m_satTexture[1] = 0;
+
 	/*
 	// Debug console window so printf works
 	FILE* pCout; // should really be freed on exit 
@@ -270,7 +647,7 @@ AutoThreshold::AutoThreshold()
 
 	// Input properties
 	SetMinInputs(1);
-	SetMaxInputs(1);
+	SetMaxInputs(NUM_INPUTS); // input and optional mask
 
 	// Parameters
 	SetParamInfo(FFPARAM_Threshold,  "Threshold",  FF_TYPE_STANDARD, 0.5f);  m_UserThreshold = 0.5f;
@@ -286,7 +663,39 @@ AutoThreshold::AutoThreshold()
 	SetParamInfo(FFPARAM_Grn2,       "Green 2",    FF_TYPE_STANDARD, 0.0f);  m_Grn2 = 0.0f;
 	SetParamInfo(FFPARAM_Blu2,       "Blue 2",     FF_TYPE_STANDARD, 0.0f);  m_Blu2 = 0.0f;
 	SetParamInfo(FFPARAM_Alf2,       "Alpha 2",    FF_TYPE_STANDARD, 1.0f);  m_Alf2 = 1.0f;
+	SetParamInfo(FFPARAM_Method,     "Method",     FF_TYPE_STANDARD, 0.0f);  m_MethodValue = 0.0f; m_Method = METHOD_GRADIENT;
+	SetParamInfo(FFPARAM_Decimation, "Decimation", FF_TYPE_STANDARD, 0.0f);  m_DecimationValue = 0.0f; m_Decimation = 1;
+	SetParamInfo(FFPARAM_Gpu,        "GPU",        FF_TYPE_BOOLEAN, false);  m_Gpu = 0;
+	SetParamInfo(FFPARAM_Async,      "Async",      FF_TYPE_BOOLEAN, false);  m_Async = 0;
+	SetParamInfo(FFPARAM_Interval,   "Interval",   FF_TYPE_STANDARD, 0.0f);  m_IntervalValue = 0.0f; m_Interval = 1;
+	SetParamInfo(FFPARAM_Damping,    "Damping",    FF_TYPE_STANDARD, 0.0f);  m_Damping = 0.0f;
+	SetParamInfo(FFPARAM_Incremental,"Incremental",FF_TYPE_BOOLEAN, false);  m_Incremental = 0;
+	SetParamInfo(FFPARAM_Luma,       "Luma",       FF_TYPE_BOOLEAN, false);  m_Luma = 0;
+	SetParamInfo(FFPARAM_Profile,    "Profile",    FF_TYPE_BOOLEAN, false);  m_Profile = 0;
+	SetParamInfo(FFPARAM_Budget,     "Budget",     FF_TYPE_STANDARD, 0.0f);  m_Budget = 0.0f;
+	SetParamInfo(FFPARAM_RoiX,       "ROI X",      FF_TYPE_STANDARD, 0.0f);  m_RoiX = 0.0f;
+	SetParamInfo(FFPARAM_RoiY,       "ROI Y",      FF_TYPE_STANDARD, 0.0f);  m_RoiY = 0.0f;
+	SetParamInfo(FFPARAM_RoiWidth,   "ROI Width",  FF_TYPE_STANDARD, 1.0f);  m_RoiWidth = 1.0f;
+	SetParamInfo(FFPARAM_RoiHeight,  "ROI Height", FF_TYPE_STANDARD, 1.0f);  m_RoiHeight = 1.0f;
+	SetParamInfo(FFPARAM_Adaptive,   "Adaptive",   FF_TYPE_BOOLEAN, false);  m_Adaptive = 0;
+	SetParamInfo(FFPARAM_Local,      "Local",      FF_TYPE_BOOLEAN, false);  m_Local = 0;
+	SetParamInfo(FFPARAM_Radius,     "Radius",     FF_TYPE_STANDARD, 0.25f); m_Radius = 0.25f;
+	SetParamInfo(FFPARAM_Levels,     "Levels",     FF_TYPE_STANDARD, 0.0f);  m_LevelsValue = 0.0f; m_Levels = 2;
+
+	// The parameter block starts with the values of the members
+	for(int i=0; i<NUM_PARAMS; i++) {
+		m_frameValue[i] = ParameterValue(i);
+		m_paramValue[i] = m_frameValue[i];
+	}
+
+}
 
+AutoThreshold::~AutoThreshold()
+{
+	StopWorker();
+	FreeImage();
+	if(m_profileFile) CloseProfileLog();
+	EstimateCache::Remove(this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -295,54 +704,133 @@ AutoThreshold::AutoThreshold()
 
 DWORD AutoThreshold::InitGL(const FFGLViewportStruct *vp)
 {
-	// initialize gl extensions and
+	// initialize gl extensions once for the context and
 	// make sure required features are supported
-	m_extensions.Initialize();
-	if (m_extensions.multitexture==0 || m_extensions.ARB_shader_objects==0)
+	m_shared = SharedShaders::Acquire();
+	if(!m_shared->bInitialized)
+		m_shared->extensions.Initialize();
+	m_extensions = m_shared->extensions;
+	if (m_extensions.multitexture==0 || m_extensions.ARB_shader_objects==0) {
+		SharedShaders::Release(m_shared, this);
+		m_shared = NULL;
 		return FF_FAIL;
-
-	// initialize gl shader
-	m_shader.SetExtensions(&m_extensions);
-	if (!m_shader.Compile(vertexShaderCode, fragmentShaderCode))
-	  MessageBoxA(NULL, "Shader compile error", "Error", MB_OK);
- 
-	// activate our shader
-	bool success = false;
-	if (m_shader.IsReady()) {
-		if (m_shader.BindShader())
-			success = true;
-	}
-
-	if (!success){
-		MessageBoxA(NULL, "Shader bind error", "Error", MB_OK);
 	}
 
+	// The user threshold stays as the parameter block has it
 	m_Threshold = 0.0;
-	m_UserThreshold = 0.0;
 	m_AutoThreshold = 0.0;
-    
-	// lookup location of the uniforms
-	m_thresholdLocation   = m_shader.FindUniform("Threshold");
-	m_smoothnessLocation  = m_shader.FindUniform("Smoothness");
-	m_twotoneLocation     = m_shader.FindUniform("TwoTone");
-	m_ChromaLocation      = m_shader.FindUniform("Chroma");
-	m_red1Location        = m_shader.FindUniform("Red1");
-	m_grn1Location        = m_shader.FindUniform("Grn1");
-	m_blu1Location        = m_shader.FindUniform("Blu1");
-	m_alf1Location        = m_shader.FindUniform("Alf1");
-	m_red2Location        = m_shader.FindUniform("Red2");
-	m_grn2Location        = m_shader.FindUniform("Grn2");
-	m_blu2Location        = m_shader.FindUniform("Blu2");
-	m_alf2Location        = m_shader.FindUniform("Alf2");
-
-	m_shader.UnbindShader();
+
+	// Shaders for 2D input textures, unless another instance has them
+	// Those for rectangle textures are compiled when first needed
+	if(!m_shared->bInitialized) {
+		CompileShaders(TARGET_2D);
+		CompileResolve();
+		m_shared->bInitialized = true;
+	}
+	for(int i=0; i<NUM_SHADERS; i++) {
+		m_UniformDirty[i] = UNIFORM_ALL;
+		m_UniformThreshold[i] = -1.0f;
+		memset((void *)m_UniformFrame[i], 0, sizeof(m_UniformFrame[i]));
+	}
+	for(int i=0; i<NUM_INPUTS; i++)
+		m_InputHandle[i] = 0;
+
+	// Full screen quad
+	m_extensions.glGenBuffers(1, &m_quadVbo);
+	m_QuadS = -1.0f; // loaded by the first draw
+	m_QuadT = -1.0f;
+	m_QuadMinS = 0.0f;
+	m_QuadMinT = 0.0f;
+
+	// Readback buffers are created here but storage
+	// is allocated when the texture size is known
+	m_extensions.glGenBuffers(NUM_PBOS, m_pbo);
+	m_extensions.glGenFramebuffersEXT(1, &m_fbo);
+	m_PboIndex  = 0;
+	m_PboFrames = 0;
+	m_PboWidth  = 0;
+	m_PboHeight = 0;
+
+	// Decimated readback and GPU reduction
+	m_DownWidth  = 0;
+	m_DownHeight = 0;
+	m_ReduceWidth  = 0;
+	m_ReduceHeight = 0;
+
+	// Threshold from the reduction
+	m_ThresholdIndex = 0;
+
+	// Scene change probe
+	m_extensions.glGenBuffers(NUM_PBOS, m_probePbo);
+	m_ProbeIndex  = 0;
+	m_ProbeFrames = 0;
+	m_bProbeRef   = false;
+	m_FrameCount  = 0;
+	m_SceneFrames = 0;
 
 	return FF_SUCCESS;
 }
 
 DWORD AutoThreshold::DeInitGL()
 {
-	m_shader.FreeGLResources();
+	if(m_quadVbo) m_extensions.glDeleteBuffers(1, &m_quadVbo);
+	m_quadVbo = 0;
+
+	if(m_pbo[0]) m_extensions.glDeleteBuffers(NUM_PBOS, m_pbo);
+	if(m_fbo) m_extensions.glDeleteFramebuffersEXT(1, &m_fbo);
+	memset((void *)m_pbo, 0, NUM_PBOS*sizeof(GLuint));
+	m_fbo = 0;
+	m_PboFrames = 0;
+	m_PboWidth  = 0;
+	m_PboHeight = 0;
+
+	if(m_reduceTexture) glDeleteTextures(1, &m_reduceTexture);
+	m_reduceTexture = 0;
+	m_ReduceWidth  = 0;
+	m_ReduceHeight = 0;
+
+	if(m_thresholdTexture[0]) glDeleteTextures(2, m_thresholdTexture);
+	m_thresholdTexture[0] = 0;
+	m_thresholdTexture[1] = 0;
+
+	if(m_tileTexture[0]) glDeleteTextures(2, m_tileTexture);
+	m_tileTexture[0] = 0;
+	m_tileTexture[1] = 0;
+
+	if(m_satTexture[0]) glDeleteTextures(2, m_satTexture);
+	m_satTexture[0] = 0;
+	m_satTexture[1] = 0;
+	m_SatWidth  = 0;
+	m_SatHeight = 0;
+
+	if(m_lutTexture) glDeleteTextures(1, &m_lutTexture);
+	m_lutTexture = 0;
+
+	if(m_downTexture) glDeleteTextures(1, &m_downTexture);
+	m_downTexture = 0;
+	m_DownWidth  = 0;
+	m_DownHeight = 0;
+
+	if(m_probePbo[0]) m_extensions.glDeleteBuffers(NUM_PBOS, m_probePbo);
+	if(m_probeTexture) glDeleteTextures(1, &m_probeTexture);
+	memset((void *)m_probePbo, 0, NUM_PBOS*sizeof(GLuint));
+	m_probeTexture = 0;
+	m_ProbeFrames = 0;
+	m_bProbeRef = false;
+
+	// The worker may be using the image buffer
+	WaitWorker();
+	FreeImage();
+
+	StopProfile();
+
+	// Shaders are freed with the last instance of the context
+	EstimateCache::Remove(this);
+	m_bEstimateOwner = false;
+	SharedShaders::Release(m_shared, this);
+	m_shared = NULL;
+	for(int i=0; i<NUM_INPUTS; i++)
+		m_InputHandle[i] = 0;
 	return FF_SUCCESS;
 }
 
@@ -350,96 +838,305 @@ DWORD AutoThreshold::ProcessOpenGL(ProcessOpenGLStruct *pGL)
 {
 	if (pGL->numInputTextures < 1) return FF_FAIL;
 	if (pGL->inputTextures[0] == NULL) return FF_FAIL;
+	if (!m_shared) return FF_FAIL;
+
+	// The host draws into its own FBO
+	m_HostFBO = pGL->HostFBO;
+
+	// Parameters set by the host since the last frame
+	ReadParameters();
 
 	FFGLTextureStruct &Texture = *(pGL->inputTextures[0]);
 	FFGLTexCoords maxCoords = GetMaxGLTexCoords(Texture);
 
-	// For auto threshold, use the threshold from the last frame, modified by the user entry
+	// Rectangle textures are sampled in pixels
+	GLuint target = InputTarget(Texture.Handle);
+	int targetIndex = TargetIndex(target);
+	if(target == GL_TEXTURE_RECTANGLE_EXT) {
+		maxCoords.s = (double)Texture.Width;
+		maxCoords.t = (double)Texture.Height;
+	}
+	if(!m_shared->bTargetShaders[targetIndex])
+		CompileShaders(targetIndex);
+
+	// Smooth in a new estimate from the last frame or the worker
+	if(m_bNewThreshold.exchange(false)) {
+		SmoothLevels();
+		SmoothThreshold(m_NewThreshold.load());
+	}
+
+	// Profile started or stopped between frames
+	if(m_Profile && !m_bProfile)
+		StartProfile();
+	else if(!m_Profile && m_bProfile)
+		StopProfile();
+
+	// For auto threshold, use the threshold from the last frame read back, modified by the user entry
 	// printf("Auto=%f, User = %f, Thresh=%f\n", m_AutoThreshold, m_UserThreshold, m_Threshold);
 	if(m_Auto)
-		m_Threshold = m_AutoThreshold*m_UserThreshold*2.0f;
+		m_Threshold = m_AutoThreshold.load()*m_UserThreshold*2.0f;
 	else
 		m_Threshold = m_UserThreshold;
 
 	if(m_Threshold < 0.0) m_Threshold = 0.0;
 	if(m_Threshold > 1.0) m_Threshold = 1.0;
 
+	// GPU option
+	// The gradient threshold for this frame is made by the GPU
+	// and used by the shader directly without a readback
+	// The adaptive mode makes a threshold for each tile in the same way
+	// and the local mode one for each pixel from the summed area table
+	bool bGpuAuto = false;
+	int source = AUTO_UNIFORM;
+	if(m_Auto && m_Local) {
+		if(SummedArea(Texture.Handle, target, Texture.Width, Texture.Height, (float)maxCoords.s, (float)maxCoords.t)) {
+			bGpuAuto = true;
+			source = AUTO_LOCAL;
+			m_Threshold = m_UserThreshold;
+		}
+	}
+	else if(m_Auto && m_Adaptive) {
+		if(ReduceGradient(Texture.Handle, target, Texture.Width, Texture.Height, (float)maxCoords.s, (float)maxCoords.t)
+		&& ResolveTiles()) {
+			bGpuAuto = true;
+			source = AUTO_ADAPTIVE;
+			m_Threshold = m_UserThreshold;
+		}
+	}
+	else if(m_Auto && m_Gpu && ThresholdStats::s_methods[m_Method].needs == STATS_GRADIENT) {
+		if(ReduceGradient(Texture.Handle, target, Texture.Width, Texture.Height, (float)maxCoords.s, (float)maxCoords.t)
+		&& ResolveThreshold((float)maxCoords.s, (float)maxCoords.t)) {
+			bGpuAuto = true;
+			source = AUTO_GPU;
+			m_Threshold = m_UserThreshold;
+		}
+	}
+
+	// Shader for the mode
+	// Two tone and chroma together are B&W
+	int mode = SHADER_BW;
+	if(m_TwoTone > 0 && m_Chroma <= 0)
+		mode = SHADER_TWOTONE;
+	else if(m_Chroma > 0 && m_TwoTone <= 0)
+		mode = SHADER_CHROMA;
+	int levels = (mode == SHADER_TWOTONE) ? m_Levels : 2; // posterised two tone levels
+
+	// Posterise levels from the multi level Otsu of the last estimate
+	// or evenly spaced about the threshold
+	float scale[MAX_LEVELS-1];
+	for(int i=0; i<MAX_LEVELS-1; i++) {
+		if(m_Auto && source == AUTO_UNIFORM && m_ScaleLevels == levels && i < levels-1)
+			scale[i] = m_LevelScale[i];
+		else
+			scale[i] = 2.0f*(float)(i+1)/(float)levels;
+	}
+
+	// B&W and two tone with a uniform threshold are drawn from the lookup table
+	bool bLut = (source == AUTO_UNIFORM && mode != SHADER_CHROMA);
+	if(bLut)
+		UpdateLut(mode, levels, scale);
+
+	if(bGpuAuto || bLut) {
+		mode += NUM_MODES*source;
+		m_extensions.glActiveTexture(GL_TEXTURE1);
+		if(bLut)
+			glBindTexture(GL_TEXTURE_2D, m_lutTexture);
+		else if(source == AUTO_LOCAL)
+			glBindTexture(GL_TEXTURE_2D, m_satTexture[m_SatIndex]);
+		else if(source == AUTO_ADAPTIVE)
+			glBindTexture(GL_TEXTURE_2D, m_tileTexture[m_TileIndex]);
+		else
+			glBindTexture(GL_TEXTURE_2D, m_thresholdTexture[m_ThresholdIndex]);
+		m_extensions.glActiveTexture(GL_TEXTURE0);
+	}
+	mode += NUM_MODES*NUM_AUTO*targetIndex;
+
 	// activate our shader
-	m_shader.BindShader();
+	m_shared->shader[mode].BindShader();
 
 	// Set the threshold to the shader
-	m_extensions.glUniform1fARB(m_thresholdLocation, m_Threshold);
-	m_extensions.glUniform1fARB(m_smoothnessLocation, m_Smoothness);
-	m_extensions.glUniform1iARB(m_twotoneLocation, m_TwoTone);
-	m_extensions.glUniform1iARB(m_ChromaLocation, m_Chroma);
-	m_extensions.glUniform1fARB(m_red1Location, m_Red1);
-	m_extensions.glUniform1fARB(m_grn1Location, m_Grn1);
-	m_extensions.glUniform1fARB(m_blu1Location, m_Blu1);
-	m_extensions.glUniform1fARB(m_alf1Location, m_Alf1);
-	m_extensions.glUniform1fARB(m_red2Location, m_Red2);
-	m_extensions.glUniform1fARB(m_grn2Location, m_Grn2);
-	m_extensions.glUniform1fARB(m_blu2Location, m_Blu2);
-	m_extensions.glUniform1fARB(m_alf2Location, m_Alf2);
+	// Uniforms stay with the program so only changes are loaded,
+	// all of them if another instance has used it since
+	if(m_shared->uniformUser[mode] != this) {
+		m_UniformDirty[mode] = UNIFORM_ALL;
+		m_UniformThreshold[mode] = -1.0f;
+		m_shared->uniformUser[mode] = this;
+	}
+	if(m_Threshold != m_UniformThreshold[mode]) {
+		m_extensions.glUniform1fARB(m_shared->thresholdLocation[mode], m_Threshold);
+		m_UniformThreshold[mode] = m_Threshold;
+	}
+
+	// Uniforms that follow the frame are compared with those last loaded
+	// Programs that do not use them have no location and are not loaded
+	float frame[UNIFORM_FRAME_VALUES] = {
+		1.0f/(float)maxCoords.s, 1.0f/(float)maxCoords.t,
+		(float)m_SatWidth, (float)m_SatHeight, floorf(1.0f + m_Radius*(float)(MAX_RADIUS-1)),
+		(float)levels, scale[0], scale[1], scale[2]
+	};
+	float *loaded = m_UniformFrame[mode];
+	if(m_shared->texScaleLocation[mode] >= 0 && memcmp((const void *)&frame[0], (const void *)&loaded[0], 2*sizeof(float)) != 0)
+		m_UniformDirty[mode] |= UNIFORM_TEXSCALE;
+	if(m_shared->satSizeLocation[mode] >= 0 && memcmp((const void *)&frame[2], (const void *)&loaded[2], 3*sizeof(float)) != 0)
+		m_UniformDirty[mode] |= UNIFORM_SAT;
+	if(m_shared->levelsLocation[mode] >= 0 && memcmp((const void *)&frame[5], (const void *)&loaded[5], 4*sizeof(float)) != 0)
+		m_UniformDirty[mode] |= UNIFORM_LEVELS;
+
+	if(m_UniformDirty[mode]) {
+		if(m_UniformDirty[mode] & UNIFORM_SMOOTHNESS)
+			m_extensions.glUniform1fARB(m_shared->smoothnessLocation[mode], m_Smoothness);
+		if(m_UniformDirty[mode] & UNIFORM_COLOR1)
+			m_extensions.glUniform4fARB(m_shared->color1Location[mode], m_Red1, m_Grn1, m_Blu1, m_Alf1);
+		if(m_UniformDirty[mode] & UNIFORM_COLOR2)
+			m_extensions.glUniform4fARB(m_shared->color2Location[mode], m_Red2, m_Grn2, m_Blu2, m_Alf2);
+		if((m_UniformDirty[mode] & UNIFORM_TEXSCALE) && m_shared->texScaleLocation[mode] >= 0)
+			m_extensions.glUniform2fARB(m_shared->texScaleLocation[mode], frame[0], frame[1]);
+		if((m_UniformDirty[mode] & UNIFORM_SAT) && m_shared->satSizeLocation[mode] >= 0) {
+			m_extensions.glUniform2fARB(m_shared->satSizeLocation[mode], frame[2], frame[3]);
+			m_extensions.glUniform1fARB(m_shared->radiusLocation[mode], frame[4]);
+		}
+		if((m_UniformDirty[mode] & UNIFORM_LEVELS) && m_shared->levelsLocation[mode] >= 0) {
+			m_extensions.glUniform1fARB(m_shared->levelsLocation[mode], frame[5]);
+			m_extensions.glUniform3fARB(m_shared->levelScaleLocation[mode], frame[6], frame[7], frame[8]);
+		}
+		memcpy((void *)loaded, (const void *)frame, sizeof(frame));
+		m_UniformDirty[mode] = 0;
+	}
 
 	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, Texture.Handle);
+	glBindTexture(target, Texture.Handle);
 
-	glBegin(GL_QUADS);
-		//lower left
-		glTexCoord2f(0.0, 0.0);
-		glVertex2f(-1.0, -1.0);
-		//upper left
-		glTexCoord2f(0.0, (float)maxCoords.t);
-		glVertex2f(-1.0, 1.0);
-		//upper right
-		glTexCoord2f((float)maxCoords.s, (float)maxCoords.t);
-		glVertex2f(1.0, 1.0);
-		//lower right
-		glTexCoord2f((float)maxCoords.s, 0.0);
-		glVertex2f(1.0, -1.0);
-	glEnd();
+	double drawStart = ProfileStart();
+	bool bQuery = BeginQuery(PROFILE_GPU_DRAW);
+	DrawQuad((float)maxCoords.s, (float)maxCoords.t);
+	if(bQuery) EndQuery(PROFILE_GPU_DRAW);
+	ProfileEnd(PROFILE_DRAW, drawStart);
 
 	// unbind the input texture
-	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindTexture(target, 0);
+	if(bGpuAuto || bLut) {
+		m_extensions.glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		m_extensions.glActiveTexture(GL_TEXTURE0);
+	}
   
 	// unbind the shader
-	m_shader.UnbindShader();
+	m_shared->shader[mode].UnbindShader();
 
 	//
 	// Auto threshold option
-	// TODO - make more efficient
 	//
-	if(m_Auto) {
+	m_bEstimateOwner = false;
+	double budgetStart = BudgetStart();
+	if(m_Auto && !bGpuAuto)
+		SetMask(pGL, maxCoords);
+	if(!m_Auto || bGpuAuto) {
+		// Nothing to read back
+	}
+	else if(!ClaimEstimate(Texture, levels)) {
+		// Estimates are made by another instance with the same input
+		float threshold;
+		bool bScene;
+		if(EstimateCache::Read(m_estimateKey, m_EstimateFrame, m_SharedCount, threshold, bScene)) {
+			m_SceneFrames = bScene ? 1 : 0;
+			PublishThreshold(threshold);
+		}
+	}
+	else if(!EstimateFrame(Texture.Handle, target, (float)maxCoords.s, (float)maxCoords.t)) {
+		// Nothing is read back between estimates
+	}
+	else {
+
+		// Region of the frame to read back
+		unsigned int roi[4];
+		RegionOfInterest(Texture.Width, Texture.Height, roi);
+		GLuint readTexture = Texture.Handle;
+		GLuint readTarget  = target;
+		unsigned int readX = roi[0];
+		unsigned int readY = roi[1];
+		unsigned int readWidth  = roi[2];
+		unsigned int readHeight = roi[3];
+		int stride = 4*m_BudgetStride; // sample every fourth line and column of the full frame
+		bool bMask = (m_MaskHandle != 0);
+		int bytes  = (m_Luma && !bMask) ? 1 : 4; // bytes per pixel read back
+
+		// Decimated readback
+		// The smaller frame is sampled at a reduced stride so that
+		// the gradient still covers the same grid as the full frame
+		int decimation = m_BudgetDecimation;
+		bool bDecimate = (decimation > 1 && roi[2] >= (unsigned int)decimation*4 && roi[3] >= (unsigned int)decimation*4);
+		if(bDecimate) {
+			readWidth  = roi[2]/decimation;
+			readHeight = roi[3]/decimation;
+		}
 
-		// Allocate an image buffer
-		unsigned char *buffer = (unsigned char *)malloc(Texture.Width*Texture.Height*4*sizeof(unsigned char)); // assume ARGB
-		
-		// Load the buffer with the texture pixels via PBO
-		LoadFromTexture(Texture.Handle, GL_TEXTURE_2D, Texture.Width, Texture.Height, buffer);
+		// The luminance and mask passes are drawn at full size if not decimated
+		// Otherwise the region is read from the input directly
+		if(bDecimate || bytes == 1 || bMask) {
+			float minS = (float)maxCoords.s*(float)roi[0]/(float)Texture.Width;
+			float minT = (float)maxCoords.t*(float)roi[1]/(float)Texture.Height;
+			float maxS = (float)maxCoords.s*(float)(roi[0] + roi[2])/(float)Texture.Width;
+			float maxT = (float)maxCoords.t*(float)(roi[1] + roi[3])/(float)Texture.Height;
+			if(Downsample(Texture.Handle, target, minS, minT, maxS, maxT, readWidth, readHeight, bytes == 1, bMask)) {
+				readTexture = m_downTexture;
+				readTarget  = GL_TEXTURE_2D;
+				readX = 0;
+				readY = 0;
+				if(bDecimate)
+					stride = MAX(1, 4/decimation)*m_BudgetStride;
+			}
+			else {
+				readWidth  = roi[2];
+				readHeight = roi[3];
+				bytes = 4;
+				bMask = false;
+			}
+		}
 
-		// Gradient method
-		m_AutoThreshold = gradient(buffer, Texture.Width, Texture.Height); 
-		// printf("Gradient %5.3f\n", m_AutoThreshold);
+		ImageView view;
+		if(m_workerBusy) {
+			// The worker has not finished with the last frame.
+			// Keep the PBO ring going but drop this frame.
+			ReadTexture(readTexture, readTarget, readWidth, readHeight, bytes, readX, readY);
+		}
+		else if(m_Async) {
+			// Copy the oldest frame of the PBO ring for the background worker
+			unsigned char *buffer = AllocateImage(readWidth*readHeight*bytes);
+			if(buffer && MapTexture(readTexture, readTarget, readWidth, readHeight, view, bytes, readX, readY)) {
+				double copyStart = ProfileStart();
+				CopyMemory((void *)buffer, (const void *)view.data, view.pitch*view.height);
+				ProfileEnd(PROFILE_COPY, copyStart);
+				UnmapTexture();
+				view.data = buffer;
+				view.mask = bMask ? 1 : 0;
+				SubmitWorker(view, stride, m_Method, levels, m_Incremental > 0);
+			}
+		}
+		// Read the texture pixels via PBO
+		// Nothing is returned until the PBO ring has filled.
+		// The estimators work on the mapped PBO memory directly.
+		else if(MapTexture(readTexture, readTarget, readWidth, readHeight, view, bytes, readX, readY)) {
 
-		// Entropy split method
-		// http://rsb.info.nih.gov/ij/plugins/download/AutoThresholder.java
-		// http://fiji.sc/wiki/index.php/Auto_Threshold#RenyiEntropy
-		// histo(buffer, (int)Texture.Width, (int)Texture.Height, m_histogram);
-		// int iThresh = entropySplit(m_histogram); // entropy auto threshold
-		// m_AutoThreshold = ((float)iThresh)/256;
-		// printf("Entropy %5.3f\n", m_AutoThreshold);
+			view.mask = bMask ? 1 : 0;
 
-		// Otsu method
-		// http://www.labbookpages.co.uk/software/imgProc/otsuThreshold.html
-		// http://cis.k.hosei.ac.jp/~wakahara/otsu_th.c
-		// int iThresh = otsu((int)Texture.Width, (int)Texture.Height, m_histogram);
-		// m_AutoThreshold = ((float)iThresh)/256;
-		// printf("Otsu %5.3f\n", m_AutoThreshold);
+			// Statistics needed by the method and the threshold from them
+			double estimateStart = ProfileStart();
+			m_NewFrame = m_EstimateFrame;
+			EstimateView(view, stride, m_Method, levels, m_Incremental > 0);
+			ProfileEnd(PROFILE_ESTIMATE, estimateStart);
 
-		free((void*)buffer);
+			UnmapTexture();
+		}
 
 	}
 
+	if(m_bEstimateOwner)
+		ShareEstimate();
+
+	BudgetEnd(budgetStart);
+
+	if(m_bProfile)
+		LogProfile();
   
 	return FF_SUCCESS;
 }
@@ -448,164 +1145,1391 @@ DWORD AutoThreshold::GetParameter(DWORD dwIndex)
 {
 	DWORD dwRet;
 
-	switch (dwIndex) {
+	if(dwIndex >= NUM_PARAMS)
+		return FF_FAIL;
+
+	*((float *)(unsigned)&dwRet) = m_paramValue[dwIndex].load(std::memory_order_relaxed);
+
+	return dwRet;
+}
+
+DWORD AutoThreshold::SetParameter(const SetParameterStruct* pParam)
+{
+	float value;
+
+	if (pParam == NULL || pParam->ParameterNumber >= NUM_PARAMS)
+		return FF_FAIL;
+
+	// Applied by the next frame, see ReadParameters
+	value = *((float *)(unsigned)&(pParam->NewParameterValue));
+	if(GetParamType(pParam->ParameterNumber) == FF_TYPE_BOOLEAN)
+		value = (pParam->NewParameterValue > 0) ? 1.0f : 0.0f;
+	WriteParameter(pParam->ParameterNumber, value);
+
+	return FF_SUCCESS;
+}
+
+//
+// Parameter block
+//
+// A seqlock. SetParameter may be called by a host UI or OSC thread
+// while the GL thread draws. Each write is made between two increments
+// of the sequence, so that it is odd while a value is written. Once a
+// frame the GL thread copies the block, again if the sequence changed
+// during the copy, and applies only the values that differ from the
+// last frame. Uniforms are then only loaded when a value has changed
+// and all the members used by a frame come from the same copy.
+//
+void AutoThreshold::WriteParameter(int index, float value)
+{
+	// Writers wait for each other, the GL thread does not wait
+	std::lock_guard<std::mutex> lock(m_paramMutex);
+	unsigned int sequence = m_ParamSequence.load(std::memory_order_relaxed);
+
+	m_ParamSequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	m_paramValue[index].store(value, std::memory_order_relaxed);
+	m_ParamSequence.store(sequence + 2, std::memory_order_release);
+}
+
+void AutoThreshold::ReadParameters()
+{
+	float value[NUM_PARAMS];
+	unsigned int sequence;
+	int i;
+
+	sequence = m_ParamSequence.load(std::memory_order_acquire);
+	if(sequence == m_FrameSequence)
+		return;
+
+	for(;;) {
+		if(!(sequence & 1)) {
+			for(i=0; i<NUM_PARAMS; i++)
+				value[i] = m_paramValue[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if(m_ParamSequence.load(std::memory_order_relaxed) == sequence)
+				break;
+		}
+		std::this_thread::yield();
+		sequence = m_ParamSequence.load(std::memory_order_acquire);
+	}
+	m_FrameSequence = sequence;
+
+	for(i=0; i<NUM_PARAMS; i++) {
+		if(value[i] != m_frameValue[i]) {
+			m_frameValue[i] = value[i];
+			ApplyParameter(i, value[i]);
+		}
+	}
+}
+
+// Value of a parameter from the members it sets
+// Used to start the parameter block
+float AutoThreshold::ParameterValue(int index)
+{
+	switch (index) {
 
 		case FFPARAM_Threshold:
-			*((float *)(unsigned)&dwRet) = m_UserThreshold;
-			return dwRet;
+			return m_UserThreshold;
 
 		case FFPARAM_Smoothness:
-			*((float *)(unsigned)&dwRet) = m_Smoothness;
-			return dwRet;
+			return m_Smoothness;
 
 		case FFPARAM_Auto:
-			*((float *)(unsigned)&dwRet) = (float)m_Auto;
-			return dwRet;
+			return (float)m_Auto;
+
+		case FFPARAM_Method:
+			return m_MethodValue;
+
+		case FFPARAM_Decimation:
+			return m_DecimationValue;
+
+		case FFPARAM_Gpu:
+			return (float)m_Gpu;
+
+		case FFPARAM_Async:
+			return (float)m_Async;
+
+		case FFPARAM_Interval:
+			return m_IntervalValue;
+
+		case FFPARAM_Damping:
+			return m_Damping;
+
+		case FFPARAM_Incremental:
+			return (float)m_Incremental;
+
+		case FFPARAM_Luma:
+			return (float)m_Luma;
+
+		case FFPARAM_Profile:
+			return (float)m_Profile;
+
+		case FFPARAM_Budget:
+			return m_Budget;
+
+		case FFPARAM_RoiX:
+			return m_RoiX;
+
+		case FFPARAM_RoiY:
+			return m_RoiY;
+
+		case FFPARAM_RoiWidth:
+			return m_RoiWidth;
+
+		case FFPARAM_RoiHeight:
+			return m_RoiHeight;
+
+		case FFPARAM_Adaptive:
+			return (float)m_Adaptive;
+
+		case FFPARAM_Local:
+			return (float)m_Local;
+
+		case FFPARAM_Radius:
+			return m_Radius;
 
 		case FFPARAM_TwoTone:
-			*((float *)(unsigned)&dwRet) = (float)m_TwoTone;
-			return dwRet;
+			return (float)m_TwoTone;
+
+		case FFPARAM_Levels:
+			return m_LevelsValue;
 
 		case FFPARAM_Chroma:
-			*((float *)(unsigned)&dwRet) = (float)m_Chroma;
-			return dwRet;
+			return (float)m_Chroma;
 
 		case FFPARAM_Red1:
-			*((float *)(unsigned)&dwRet) = m_Red1;
-			return dwRet;
+			return m_Red1;
 
 		case FFPARAM_Grn1:
-			*((float *)(unsigned)&dwRet) = m_Grn1;
-			return dwRet;
+			return m_Grn1;
 
 		case FFPARAM_Blu1:
-			*((float *)(unsigned)&dwRet) = m_Blu1;
-			return dwRet;
+			return m_Blu1;
 
 		case FFPARAM_Alf1:
-			*((float *)(unsigned)&dwRet) = m_Alf1;
-			return dwRet;
+			return m_Alf1;
 
 		case FFPARAM_Red2:
-			*((float *)(unsigned)&dwRet) = m_Red2;
-			return dwRet;
+			return m_Red2;
 
 		case FFPARAM_Grn2:
-			*((float *)(unsigned)&dwRet) = m_Grn2;
-			return dwRet;
+			return m_Grn2;
 
 		case FFPARAM_Blu2:
-			*((float *)(unsigned)&dwRet) = m_Blu2;
-			return dwRet;
+			return m_Blu2;
 
 		case FFPARAM_Alf2:
-			*((float *)(unsigned)&dwRet) = m_Alf2;
-			return dwRet;
+			return m_Alf2;
 
 		default:
-			return FF_FAIL;
+			return 0.0f;
 
 	}
 }
 
-DWORD AutoThreshold::SetParameter(const SetParameterStruct* pParam)
+// A changed parameter applied to the members by the GL thread
+void AutoThreshold::ApplyParameter(int index, float value)
 {
+	switch (index) {
 
-	if (pParam != NULL) {
-		
-		switch (pParam->ParameterNumber) {
+		case FFPARAM_Threshold:
+			m_UserThreshold = value;
+			break;
 
-			case FFPARAM_Threshold:
-				m_UserThreshold = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Smoothness:
+			m_Smoothness = value;
+			SetUniformDirty(UNIFORM_SMOOTHNESS);
+			break;
 
-			case FFPARAM_Smoothness:
-				m_Smoothness = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Auto:
+			if(value > 0.0f)
+				m_Auto = 1;
+			else
+				m_Auto = 0;
+			break;
+
+		case FFPARAM_Method:
+			// Gradient, Entropy or Otsu
+			m_MethodValue = value;
+			m_Method = (int)(m_MethodValue*(float)(NUM_METHODS-1) + 0.5f);
+			m_Method = MAX(0, MIN(m_Method, NUM_METHODS-1));
+			break;
+
+		case FFPARAM_Decimation:
+			// 1, 2, 4 or 8
+			m_DecimationValue = value;
+			m_Decimation = 1 << (int)(m_DecimationValue*3.0f + 0.5f);
+			break;
+
+		case FFPARAM_Gpu:
+			if(value > 0.0f)
+				m_Gpu = 1;
+			else
+				m_Gpu = 0;
+			break;
+
+		case FFPARAM_Async:
+			if(value > 0.0f)
+				m_Async = 1;
+			else
+				m_Async = 0;
+			break;
+
+		case FFPARAM_Interval:
+			// Estimate every 1 to MAX_INTERVAL frames
+			m_IntervalValue = value;
+			m_Interval = 1 + (int)(m_IntervalValue*(float)(MAX_INTERVAL-1) + 0.5f);
+			break;
+
+		case FFPARAM_Damping:
+			m_Damping = value;
+			break;
+
+		case FFPARAM_Incremental:
+			if(value > 0.0f)
+				m_Incremental = 1;
+			else
+				m_Incremental = 0;
+			// The estimator is changed by the thread that next uses it
+			break;
+
+		case FFPARAM_Luma:
+			if(value > 0.0f)
+				m_Luma = 1;
+			else
+				m_Luma = 0;
+			break;
+
+		case FFPARAM_Profile:
+			if(value > 0.0f)
+				m_Profile = 1;
+			else
+				m_Profile = 0;
+			break;
+
+		case FFPARAM_Budget:
+			m_Budget = value;
+			break;
+
+		case FFPARAM_RoiX:
+			m_RoiX = value;
+			break;
+
+		case FFPARAM_RoiY:
+			m_RoiY = value;
+			break;
+
+		case FFPARAM_RoiWidth:
+			m_RoiWidth = value;
+			break;
+
+		case FFPARAM_RoiHeight:
+			m_RoiHeight = value;
+			break;
+
+		case FFPARAM_Adaptive:
+			if(value > 0.0f)
+				m_Adaptive = 1;
+			else
+				m_Adaptive = 0;
+			break;
+
+		case FFPARAM_Local:
+			if(value > 0.0f)
+				m_Local = 1;
+			else
+				m_Local = 0;
+			break;
+
+		case FFPARAM_Radius:
+			m_Radius = value;
+			break;
 
-			case FFPARAM_Auto:
-				if(pParam->NewParameterValue > 0)
-					m_Auto = 1;
-				else
-					m_Auto = 0;
-				break;
+		case FFPARAM_TwoTone:
+			if(value > 0.0f)
+				m_TwoTone = 1;
+			else
+				m_TwoTone = 0;
+			break;
+
+		case FFPARAM_Levels:
+			// 2, 3 or 4 levels
+			m_LevelsValue = value;
+			m_Levels = 2 + (int)(m_LevelsValue*(float)(MAX_LEVELS-2) + 0.5f);
+			m_Levels = MAX(2, MIN(m_Levels, MAX_LEVELS));
+			break;
 
-			case FFPARAM_TwoTone:
-				if(pParam->NewParameterValue > 0)
-					m_TwoTone = 1;
-				else
-					m_TwoTone = 0;
-				break;
+		case FFPARAM_Chroma:
+			if(value > 0.0f)
+				m_Chroma = 1;
+			else
+				m_Chroma = 0;
+			break;
 
+		case FFPARAM_Red1:
+			m_Red1 = value;
+			SetUniformDirty(UNIFORM_COLOR1);
+			break;
 
-			case FFPARAM_Chroma:
-				if(pParam->NewParameterValue > 0)
-					m_Chroma = 1;
-				else
-					m_Chroma = 0;
-				break;
+		case FFPARAM_Grn1:
+			m_Grn1 = value;
+			SetUniformDirty(UNIFORM_COLOR1);
+			break;
 
-			case FFPARAM_Red1:
-				m_Red1 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Blu1:
+			m_Blu1 = value;
+			SetUniformDirty(UNIFORM_COLOR1);
+			break;
 
-			case FFPARAM_Grn1:
-				m_Grn1 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Alf1:
+			m_Alf1 = value;
+			SetUniformDirty(UNIFORM_COLOR1);
+			break;
 
-			case FFPARAM_Blu1:
-				m_Blu1 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Red2:
+			m_Red2 = value;
+			SetUniformDirty(UNIFORM_COLOR2);
+			break;
 
-			case FFPARAM_Alf1:
-				m_Alf1 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Grn2:
+			m_Grn2 = value;
+			SetUniformDirty(UNIFORM_COLOR2);
+			break;
 
-			case FFPARAM_Red2:
-				m_Red2 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Blu2:
+			m_Blu2 = value;
+			SetUniformDirty(UNIFORM_COLOR2);
+			break;
 
-			case FFPARAM_Grn2:
-				m_Grn2 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		case FFPARAM_Alf2:
+			m_Alf2 = value;
+			SetUniformDirty(UNIFORM_COLOR2);
+			break;
 
-			case FFPARAM_Blu2:
-				m_Blu2 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+		default:
+			break;
+	}
+}
 
-			case FFPARAM_Alf2:
-				m_Alf2 = *((float *)(unsigned)&(pParam->NewParameterValue));
-				break;
+//
+// Compile the shaders that sample the input for a texture target
+//
+// Called by InitGL for 2D textures and by the first frame
+// with a rectangle texture. Errors are shown once in one box.
+//
+void AutoThreshold::CompileShaders(int target)
+{
+	std::string prologue = TargetSource(target);
+	std::string source;
+	std::string failed;
+	int i, k;
+
+	// a gl shader for each mode
+	// with the threshold from a uniform, from the GPU or from the tiles
+	for(k=0; k<NUM_MODES*NUM_AUTO; k++) {
+
+		i = k + NUM_MODES*NUM_AUTO*target;
+		source  = prologue;
+		source += "#define MODE " + std::to_string(k%NUM_MODES) + "\n";
+		source += "#define AUTO " + std::to_string(k/NUM_MODES) + "\n";
+		source += "#define LUT_SIZE " + std::to_string(LUT_SIZE) + ".0\n";
+		source += fragmentShaderCode;
+
+		m_shared->shader[i].SetExtensions(&m_shared->extensions);
+		bool compiled = m_shared->shader[i].Compile(vertexShaderCode, source.c_str()) != 0;
+ 
+		// activate our shader
+		bool success = false;
+		if (m_shared->shader[i].IsReady()) {
+			if (m_shared->shader[i].BindShader())
+				success = true;
+		}
 
-			default:
-				return FF_FAIL;
+		if (!success) {
+			failed += "Mode " + std::to_string(k%NUM_MODES) + " auto " + std::to_string(k/NUM_MODES);
+			failed += compiled ? " : bind error\n" : " : compile error\n";
 		}
 
-		return FF_SUCCESS;
-	
+		// lookup location of the uniforms
+		// Those not used by the mode are -1 and ignored
+		m_shared->thresholdLocation[i]   = m_shared->shader[i].FindUniform("Threshold");
+		m_shared->smoothnessLocation[i]  = m_shared->shader[i].FindUniform("Smoothness");
+		m_shared->color1Location[i]      = m_shared->shader[i].FindUniform("Color1");
+		m_shared->color2Location[i]      = m_shared->shader[i].FindUniform("Color2");
+		m_shared->texScaleLocation[i]    = m_shared->shader[i].FindUniform("TexScale");
+		m_shared->satSizeLocation[i]     = m_shared->shader[i].FindUniform("SatSize");
+		m_shared->radiusLocation[i]      = m_shared->shader[i].FindUniform("Radius");
+		m_shared->levelsLocation[i]      = m_shared->shader[i].FindUniform("Levels");
+		m_shared->levelScaleLocation[i]  = m_shared->shader[i].FindUniform("LevelScale");
+		m_extensions.glUniform1iARB(m_shared->shader[i].FindUniform("ThresholdTex"), 1);
+
+		// All uniforms are loaded by the first instance to use it
+		m_shared->uniformUser[i] = NULL;
+
+		m_shared->shader[i].UnbindShader();
+	}
+
+	// One box for all the variants that failed, for the first instance only
+	if(!failed.empty() && !s_shaderErrorShown.exchange(true))
+		MessageBoxA(NULL, ("Shader errors\n\n" + failed).c_str(), "Error", MB_OK);
+
+	// Copy and luminance shaders for readback
+	source = prologue + copyShaderCode;
+	m_shared->copyShader[target].SetExtensions(&m_shared->extensions);
+	if (m_shared->copyShader[target].Compile(vertexShaderCode, source.c_str())) {
+		m_shared->copyShader[target].BindShader();
+		m_extensions.glUniform1iARB(m_shared->copyShader[target].FindUniform("tex1"), 0);
+		m_shared->copyShader[target].UnbindShader();
+	}
+
+	source = prologue + lumaShaderCode;
+	m_shared->lumaShader[target].SetExtensions(&m_shared->extensions);
+	if (m_shared->lumaShader[target].Compile(vertexShaderCode, source.c_str())) {
+		m_shared->lumaShader[target].BindShader();
+		m_extensions.glUniform1iARB(m_shared->lumaShader[target].FindUniform("tex1"), 0);
+		m_shared->lumaShader[target].UnbindShader();
+	}
+
+	// Gradient reduction shader for the GPU option
+	source = prologue + reduceShaderCode;
+	m_shared->reduceShader[target].SetExtensions(&m_shared->extensions);
+	if (m_shared->reduceShader[target].Compile(vertexShaderCode, source.c_str())) {
+		m_shared->reduceShader[target].BindShader();
+		m_extensions.glUniform1iARB(m_shared->reduceShader[target].FindUniform("tex1"), 0);
+		m_shared->reduceTexelLocation[target] = m_shared->reduceShader[target].FindUniform("Texel");
+		m_shared->reduceShader[target].UnbindShader();
 	}
 
-	return FF_FAIL;
+	m_shared->bTargetShaders[target] = true;
 }
 
-// All this is so that the process does not stall OpenGL
-bool AutoThreshold::LoadFromTexture(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, unsigned char *data)
+// Threshold from the reduction for the GPU option
+void AutoThreshold::CompileResolve()
 {
-	GLuint pboID1 = 0;
-	GLuint tempFBO = 0;
+	m_shared->resolveShader.SetExtensions(&m_shared->extensions);
+	if (m_shared->resolveShader.Compile(vertexShaderCode, resolveShaderCode)) {
+		m_shared->resolveShader.BindShader();
+		m_extensions.glUniform1iARB(m_shared->resolveShader.FindUniform("tex1"), 0);
+		m_extensions.glUniform1iARB(m_shared->resolveShader.FindUniform("LastTex"), 1);
+		m_shared->resolveCountLocation   = m_shared->resolveShader.FindUniform("Count");
+		m_shared->resolveDampingLocation = m_shared->resolveShader.FindUniform("Damping");
+		m_shared->resolveShader.UnbindShader();
+	}
 
-	void *pboMemory;
-	m_extensions.glGenBuffers(1, &pboID1);
-	m_extensions.glGenFramebuffersEXT(1, &tempFBO); 
+	// Tile thresholds for the adaptive mode
+	m_shared->tileShader.SetExtensions(&m_shared->extensions);
+	if (m_shared->tileShader.Compile(vertexShaderCode, tileShaderCode)) {
+		m_shared->tileShader.BindShader();
+		m_extensions.glUniform1iARB(m_shared->tileShader.FindUniform("tex1"), 0);
+		m_extensions.glUniform1iARB(m_shared->tileShader.FindUniform("LastTex"), 1);
+		m_shared->tileGridLocation    = m_shared->tileShader.FindUniform("Grid");
+		m_shared->tileDampingLocation = m_shared->tileShader.FindUniform("Damping");
+		m_shared->tileShader.UnbindShader();
+	}
 
-	// GL_PIXEL_PACK_BUFFER_ARB is for transferring pixel data from OpenGL to your application,
-	// and GL_PIXEL_UNPACK_BUFFER_ARB means transferring pixel data from an application to OpenGL.
-	// OpenGL refers to these tokens to determine the best memory space of a PBO, for example,
-	// a video memory for uploading (unpacking) textures, or system memory for reading (packing)
-	// the framebuffer.
+	// Prefix sums for the local mode
+	m_shared->satShader.SetExtensions(&m_shared->extensions);
+	if (m_shared->satShader.Compile(vertexShaderCode, satShaderCode)) {
+		m_shared->satShader.BindShader();
+		m_extensions.glUniform1iARB(m_shared->satShader.FindUniform("tex1"), 0);
+		m_shared->satOffsetLocation   = m_shared->satShader.FindUniform("Offset");
+		m_shared->satSizePassLocation = m_shared->satShader.FindUniform("Size");
+		m_shared->satBiasLocation     = m_shared->satShader.FindUniform("Bias");
+		m_shared->satShader.UnbindShader();
+	}
+}
+
+// Mask readback shader for an input and mask target
+// Compiled when a mask is first connected
+void AutoThreshold::CompileMask(int target, int maskTarget)
+{
+	int i = target*NUM_TARGETS + maskTarget;
+	std::string source = TargetSource(target) + TargetSource(maskTarget, "MASK_") + maskShaderCode;
+
+	m_shared->maskShader[i].SetExtensions(&m_shared->extensions);
+	if (m_shared->maskShader[i].Compile(vertexShaderCode, source.c_str())) {
+		m_shared->maskShader[i].BindShader();
+		m_extensions.glUniform1iARB(m_shared->maskShader[i].FindUniform("tex1"), 0);
+		m_extensions.glUniform1iARB(m_shared->maskShader[i].FindUniform("MaskTex"), 1);
+		m_shared->maskScaleLocation[i] = m_shared->maskShader[i].FindUniform("MaskScale");
+		m_shared->maskShader[i].UnbindShader();
+	}
+
+	m_shared->bMaskShaders[i] = true;
+}
+
+//
+// Target of the input texture
+//
+// The host does not say whether the texture is 2D or a rectangle.
+// Binding a rectangle texture to GL_TEXTURE_2D is an error so that
+// is tried once each time the handle of an input changes.
+//
+GLuint AutoThreshold::InputTarget(GLuint TextureID, int input)
+{
+	int i;
+
+	if(TextureID == m_InputHandle[input])
+		return m_InputTarget[input];
+
+	// Errors left by the host
+	for(i=0; i<8 && glGetError() != GL_NO_ERROR; i++);
+
+	glBindTexture(GL_TEXTURE_2D, TextureID);
+	if(glGetError() == GL_NO_ERROR)
+		m_InputTarget[input] = GL_TEXTURE_2D;
+	else
+		m_InputTarget[input] = GL_TEXTURE_RECTANGLE_EXT;
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	m_InputHandle[input] = TextureID;
+
+	return m_InputTarget[input];
+}
+
+// Shader index for a texture target
+int AutoThreshold::TargetIndex(GLuint TextureTarget)
+{
+	return (TextureTarget == GL_TEXTURE_RECTANGLE_EXT) ? TARGET_RECT : TARGET_2D;
+}
+
+//
+// Mask input for auto threshold
+//
+// The mask of this frame is kept in m_MaskHandle, or 0 if the
+// host has not connected one or its shader did not compile.
+//
+void AutoThreshold::SetMask(ProcessOpenGLStruct *pGL, const FFGLTexCoords &maxCoords)
+{
+	int shader;
+
+	m_MaskHandle = 0;
+	if(pGL->numInputTextures < 2 || pGL->inputTextures[1] == NULL || pGL->inputTextures[1]->Handle == 0)
+		return;
+
+	FFGLTextureStruct &Mask = *(pGL->inputTextures[1]);
+	FFGLTexCoords maskCoords = GetMaxGLTexCoords(Mask);
+
+	m_MaskTarget = InputTarget(Mask.Handle, 1);
+	if(m_MaskTarget == GL_TEXTURE_RECTANGLE_EXT) {
+		maskCoords.s = (double)Mask.Width;
+		maskCoords.t = (double)Mask.Height;
+	}
+
+	shader = TargetIndex(m_InputTarget[0])*NUM_TARGETS + TargetIndex(m_MaskTarget);
+	if(!m_shared->bMaskShaders[shader])
+		CompileMask(TargetIndex(m_InputTarget[0]), TargetIndex(m_MaskTarget));
+	if(!m_shared->maskShader[shader].IsReady())
+		return;
+
+	// The mask is stretched over the input
+	m_MaskScaleS = (float)(maskCoords.s/maxCoords.s);
+	m_MaskScaleT = (float)(maskCoords.t/maxCoords.t);
+	m_MaskHandle = Mask.Handle;
+}
+
+//
+// Region of interest in pixels
+//
+// x, y, width and height from the bottom left as for GL. The
+// parameters are from the top left as the user sees the frame.
+//
+void AutoThreshold::RegionOfInterest(unsigned int width, unsigned int height, unsigned int roi[4])
+{
+	float right  = MIN(1.0f, m_RoiX + m_RoiWidth);
+	float bottom = MIN(1.0f, m_RoiY + m_RoiHeight);
+
+	roi[0] = (unsigned int)(m_RoiX*(float)width);
+	roi[2] = (unsigned int)(right*(float)width) - roi[0];
+	roi[1] = height - (unsigned int)(bottom*(float)height);
+	roi[3] = height - (unsigned int)(m_RoiY*(float)height) - roi[1];
+
+	// Widened to the smallest size inside the frame
+	if(roi[2] < MIN_ROI) {
+		roi[2] = MIN(width, MIN_ROI);
+		roi[0] = MIN(roi[0], width - roi[2]);
+	}
+	if(roi[3] < MIN_ROI) {
+		roi[3] = MIN(height, MIN_ROI);
+		roi[1] = MIN(roi[1], height - roi[3]);
+	}
+}
+
+// Uniforms to be loaded into every program by the next frame
+void AutoThreshold::SetUniformDirty(int flags)
+{
+	for(int i=0; i<NUM_SHADERS; i++)
+		m_UniformDirty[i] |= flags;
+}
+
+// Full viewport quad with texture coordinates
+// from minS, minT to maxS, maxT
+void AutoThreshold::DrawQuad(float maxS, float maxT, float minS, float minT)
+{
+	// Vertex buffer created by InitGL
+	// The texture coordinates are only loaded again when they change
+	if(m_quadVbo) {
+		m_extensions.glBindBuffer(GL_ARRAY_BUFFER, m_quadVbo);
+		if(maxS != m_QuadS || maxT != m_QuadT || minS != m_QuadMinS || minT != m_QuadMinT) {
+			// [x y s t] lower left, lower right, upper left, upper right
+			GLfloat quad[16] = {
+				-1.0f, -1.0f, minS, minT,
+				 1.0f, -1.0f, maxS, minT,
+				-1.0f,  1.0f, minS, maxT,
+				 1.0f,  1.0f, maxS, maxT
+			};
+			m_extensions.glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+			m_QuadS = maxS;
+			m_QuadT = maxT;
+			m_QuadMinS = minS;
+			m_QuadMinT = minT;
+		}
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glVertexPointer(2, GL_FLOAT, 4*sizeof(GLfloat), (const GLvoid *)0);
+		glTexCoordPointer(2, GL_FLOAT, 4*sizeof(GLfloat), (const GLvoid *)(2*sizeof(GLfloat)));
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glDisableClientState(GL_VERTEX_ARRAY);
+		m_extensions.glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return;
+	}
+
+	glBegin(GL_QUADS);
+		//lower left
+		glTexCoord2f(minS, minT);
+		glVertex2f(-1.0, -1.0);
+		//upper left
+		glTexCoord2f(minS, maxT);
+		glVertex2f(-1.0, 1.0);
+		//upper right
+		glTexCoord2f(maxS, maxT);
+		glVertex2f(1.0, 1.0);
+		//lower right
+		glTexCoord2f(maxS, minT);
+		glVertex2f(1.0, -1.0);
+	glEnd();
+}
+
+// Render into a texture using the readback FBO
+// The host viewport and FBO are restored by EndPass
+void AutoThreshold::BeginPass(GLuint texture, unsigned int width, unsigned int height)
+{
+	glGetIntegerv(GL_VIEWPORT, m_passViewport);
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &m_passFbo);
+	m_extensions.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, m_fbo);
+	m_extensions.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, texture, 0);
+	glViewport(0, 0, width, height);
+}
+
+void AutoThreshold::EndPass()
+{
+	m_extensions.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, 0, 0);
+	m_extensions.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, (GLuint)m_passFbo);
+	glViewport(m_passViewport[0], m_passViewport[1], m_passViewport[2], m_passViewport[3]);
+}
+
+//
+// Render the input texture into a smaller texture for decimated readback
+//
+// Linear filtering of the input averages neighbouring pixels
+// so the reduced frame is not just a subset of the full one.
+// Only the region minS, minT to maxS, maxT of the input is drawn.
+// With bLuma the luminance is drawn for single channel readback
+// and with bMask the mask set by SetMask is drawn into alpha.
+//
+bool AutoThreshold::Downsample(GLuint TextureID, GLuint TextureTarget, float minS, float minT, float maxS, float maxT, unsigned int width, unsigned int height, bool bLuma, bool bMask)
+{
+	int target = TargetIndex(TextureTarget);
+	int mask = target*NUM_TARGETS + TargetIndex(m_MaskTarget);
+	FFGLShader &shader = bMask ? m_shared->maskShader[mask] : (bLuma ? m_shared->lumaShader[target] : m_shared->copyShader[target]);
+
+	if(!shader.IsReady() || !m_fbo)
+		return false;
+
+	// Re-create the texture if the size has changed
+	if(width != m_DownWidth || height != m_DownHeight) {
+		if(!m_downTexture) glGenTextures(1, &m_downTexture);
+		glBindTexture(GL_TEXTURE_2D, m_downTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		m_DownWidth  = width;
+		m_DownHeight = height;
+	}
+
+	BeginPass(m_downTexture, width, height);
+	shader.BindShader();
+	if(bMask) {
+		m_extensions.glUniform2fARB(m_shared->maskScaleLocation[mask], m_MaskScaleS, m_MaskScaleT);
+		m_extensions.glActiveTexture(GL_TEXTURE1);
+		glBindTexture(m_MaskTarget, m_MaskHandle);
+		m_extensions.glActiveTexture(GL_TEXTURE0);
+	}
+	glBindTexture(TextureTarget, TextureID);
+	DrawQuad(maxS, maxT, minS, minT);
+	glBindTexture(TextureTarget, 0);
+	if(bMask) {
+		m_extensions.glActiveTexture(GL_TEXTURE1);
+		glBindTexture(m_MaskTarget, 0);
+		m_extensions.glActiveTexture(GL_TEXTURE0);
+	}
+	shader.UnbindShader();
+	EndPass();
+
+	return true;
+}
+
+//
+// Gradient for auto threshold calculated on the GPU
+//
+// The reduction shader renders one gradient sample for every fourth
+// pixel and column into a float texture. The mipmap chain of that
+// texture averages the samples down to a single pixel.
+//
+bool AutoThreshold::ReduceGradient(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, float maxS, float maxT)
+{
+	int target = TargetIndex(TextureTarget);
+	unsigned int w, h;
+	int i;
+
+	if(!m_shared->reduceShader[target].IsReady() || !m_fbo)
+		return false;
+
+	// One sample for every fourth pixel as for the CPU method
+	w = width/4;
+	h = height/4;
+	if(w < 1) w = 1;
+	if(h < 1) h = 1;
+
+	// Re-create the reduction texture if the size has changed
+	if(w != m_ReduceWidth || h != m_ReduceHeight) {
+		if(!m_reduceTexture) glGenTextures(1, &m_reduceTexture);
+		glBindTexture(GL_TEXTURE_2D, m_reduceTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, w, h, 0, GL_RGBA, GL_FLOAT, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		m_extensions.glGenerateMipmapEXT(GL_TEXTURE_2D); // allocate the chain
+		glBindTexture(GL_TEXTURE_2D, 0);
+		// The last level is 1x1
+		m_ReduceLevel = 0;
+		for(i = (int)MAX(w, h); i > 1; i /= 2)
+			m_ReduceLevel++;
+		m_ReduceWidth  = w;
+		m_ReduceHeight = h;
+	}
+
+	// Render the gradient samples into the reduction texture
+	BeginPass(m_reduceTexture, w, h);
+	m_shared->reduceShader[target].BindShader();
+	m_extensions.glUniform2fARB(m_shared->reduceTexelLocation[target], maxS/(float)width, maxT/(float)height);
+	glBindTexture(TextureTarget, TextureID);
+	DrawQuad(maxS, maxT);
+	glBindTexture(TextureTarget, 0);
+	m_shared->reduceShader[target].UnbindShader();
+	EndPass();
+
+	// Average down to 1x1
+	glBindTexture(GL_TEXTURE_2D, m_reduceTexture);
+	m_extensions.glGenerateMipmapEXT(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return true;
+}
+
+//
+// Lookup table of the B&W and two tone results for each luminance
+//
+// With a uniform threshold the output depends only on luminance, the
+// threshold, smoothness, posterise levels and the colours. The table
+// is made again when one of them changes and the shader replaces the
+// smoothstep and colour mix with one fetch. Smoothstep is the same as
+// in the shader and is a step for zero smoothness.
+//
+void AutoThreshold::UpdateLut(int mode, int levels, const float scale[MAX_LEVELS-1])
+{
+	unsigned char lut[LUT_SIZE*4];
+	float key[LUT_KEYS];
+	float rgba[4], t[MAX_LEVELS-1];
+	float l, f, s;
+	int i, j, k;
+
+	key[0] = (float)mode;
+	key[1] = m_Threshold;
+	key[2] = m_Smoothness;
+	key[3] = m_Red1; key[4] = m_Grn1; key[5] = m_Blu1; key[6]  = m_Alf1;
+	key[7] = m_Red2; key[8] = m_Grn2; key[9] = m_Blu2; key[10] = m_Alf2;
+	key[11] = (float)levels;
+	for(k=0; k<MAX_LEVELS-1; k++)
+		key[12+k] = (levels > 2) ? scale[k] : 0.0f;
+
+	if(m_lutTexture && memcmp((const void *)key, (const void *)m_LutKey, sizeof(key)) == 0)
+		return;
+	memcpy((void *)m_LutKey, (const void *)key, sizeof(key));
+
+	// Thresholds of the levels, one for two levels
+	t[0] = m_Threshold;
+	for(k=0; levels > 2 && k<levels-1; k++)
+		t[k] = MAX(0.0f, MIN(m_Threshold*scale[k], 1.0f));
+
+	for(i=0; i<LUT_SIZE; i++) {
+		l = (float)i/(float)(LUT_SIZE-1);
+		f = 0.0f;
+		for(k=0; k<MAX(1, levels-1); k++) {
+			if(m_Smoothness > 0.0f) {
+				s = MAX(0.0f, MIN((l - t[k])/m_Smoothness, 1.0f));
+				f += s*s*(3.0f - 2.0f*s);
+			}
+			else if(l > t[k]) {
+				f += 1.0f;
+			}
+		}
+		if(levels > 2)
+			f /= (float)(levels-1);
+
+		if(mode == SHADER_TWOTONE) {
+			rgba[0] = f*m_Red1 + (1.0f-f)*m_Red2;
+			rgba[1] = f*m_Grn1 + (1.0f-f)*m_Grn2;
+			rgba[2] = f*m_Blu1 + (1.0f-f)*m_Blu2;
+			rgba[3] = f*m_Alf1 + (1.0f-f)*m_Alf2;
+		}
+		else {
+			rgba[0] = rgba[1] = rgba[2] = f;
+			rgba[3] = (f > 0.5f) ? m_Alf2 : m_Alf1;
+		}
+		for(j=0; j<4; j++)
+			lut[i*4+j] = (unsigned char)(MAX(0.0f, MIN(rgba[j], 1.0f))*255.0f + 0.5f);
+	}
+
+	if(!m_lutTexture) {
+		glGenTextures(1, &m_lutTexture);
+		glBindTexture(GL_TEXTURE_2D, m_lutTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, LUT_SIZE, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid *)lut);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	else {
+		glBindTexture(GL_TEXTURE_2D, m_lutTexture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, LUT_SIZE, 1, GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid *)lut);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+//
+// Threshold from the reduction into a 1x1 texture
+//
+// The threshold shader samples it in the same frame so there is
+// no readback and no wait for the GPU. Two textures take turns
+// so that the last threshold can be mixed in for damping.
+//
+bool AutoThreshold::ResolveThreshold(float maxS, float maxT)
+{
+	int i, last;
+
+	if(!m_shared->resolveShader.IsReady() || !m_fbo)
+		return false;
+
+	if(!m_thresholdTexture[0]) {
+		const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		glGenTextures(2, m_thresholdTexture);
+		for(i=0; i<2; i++) {
+			glBindTexture(GL_TEXTURE_2D, m_thresholdTexture[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, 1, 1, 0, GL_RGBA, GL_FLOAT, zero);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		m_ThresholdIndex = 0;
+	}
+
+	last = m_ThresholdIndex;
+	m_ThresholdIndex = 1 - m_ThresholdIndex;
+
+	// The input texture coordinates cover the reduction texture
+	// and the quad does not have to be loaded again
+	BeginPass(m_thresholdTexture[m_ThresholdIndex], 1, 1);
+	m_shared->resolveShader.BindShader();
+	m_extensions.glUniform1fARB(m_shared->resolveCountLocation, (float)m_ReduceWidth*(float)m_ReduceHeight);
+	m_extensions.glUniform1fARB(m_shared->resolveDampingLocation, m_Damping*MAX_DAMPING);
+	m_extensions.glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, m_thresholdTexture[last]);
+	m_extensions.glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, m_reduceTexture);
+	DrawQuad(maxS, maxT);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	m_extensions.glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	m_extensions.glActiveTexture(GL_TEXTURE0);
+	m_shared->resolveShader.UnbindShader();
+	EndPass();
+
+	return true;
+}
+
+//
+// Threshold for each tile of the adaptive mode
+//
+// Drawn from the reduction into an ADAPTIVE_GRID x ADAPTIVE_GRID
+// texture in the same way as ResolveThreshold. The grid is filtered
+// linearly so the threshold changes smoothly between tile centres.
+//
+bool AutoThreshold::ResolveTiles()
+{
+	int i, last;
+
+	if(!m_shared->tileShader.IsReady() || !m_fbo)
+		return false;
+
+	if(!m_tileTexture[0]) {
+		GLfloat zero[ADAPTIVE_GRID*ADAPTIVE_GRID*4];
+		memset((void *)zero, 0, sizeof(zero));
+		glGenTextures(2, m_tileTexture);
+		for(i=0; i<2; i++) {
+			glBindTexture(GL_TEXTURE_2D, m_tileTexture[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, ADAPTIVE_GRID, ADAPTIVE_GRID, 0, GL_RGBA, GL_FLOAT, zero);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		m_TileIndex = 0;
+	}
+
+	last = m_TileIndex;
+	m_TileIndex = 1 - m_TileIndex;
+
+	// The tile is found from the fragment position
+	// so the quad coordinates are not used
+	BeginPass(m_tileTexture[m_TileIndex], ADAPTIVE_GRID, ADAPTIVE_GRID);
+	m_shared->tileShader.BindShader();
+	m_extensions.glUniform2fARB(m_shared->tileGridLocation, (float)ADAPTIVE_GRID, (float)ADAPTIVE_GRID);
+	m_extensions.glUniform1fARB(m_shared->tileDampingLocation, m_Damping*MAX_DAMPING);
+	m_extensions.glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, m_tileTexture[last]);
+	m_extensions.glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, m_reduceTexture);
+	DrawQuad(m_QuadS, m_QuadT, m_QuadMinS, m_QuadMinT);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	m_extensions.glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	m_extensions.glActiveTexture(GL_TEXTURE0);
+	m_shared->tileShader.UnbindShader();
+	EndPass();
+
+	return true;
+}
+
+//
+// Summed area table of luminance for the local mode
+//
+// The luminance is drawn at 1/SAT_DIVISOR of the input size and
+// then summed along the lines and up the columns by passes that
+// each add the texel 1, 2, 4 ... texels before. That is about
+// 2*log2(size) passes over the small texture, after which the
+// mean of any square is four reads. Luminance - 0.5 is summed so
+// that the float sums keep their precision over the whole frame.
+//
+bool AutoThreshold::SummedArea(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, float maxS, float maxT)
+{
+	int target = TargetIndex(TextureTarget);
+	unsigned int w, h, offset;
+	int i, src;
+
+	if(!m_shared->satShader.IsReady() || !m_shared->lumaShader[target].IsReady() || !m_fbo)
+		return false;
+
+	w = MAX(1, width/SAT_DIVISOR);
+	h = MAX(1, height/SAT_DIVISOR);
+
+	// Re-create the textures if the size has changed
+	if(w != m_SatWidth || h != m_SatHeight) {
+		if(!m_satTexture[0]) glGenTextures(2, m_satTexture);
+		for(i=0; i<2; i++) {
+			glBindTexture(GL_TEXTURE_2D, m_satTexture[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, w, h, 0, GL_RGBA, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		m_SatWidth  = w;
+		m_SatHeight = h;
+	}
+
+	// Luminance, filtered down by the texture sampler
+	BeginPass(m_satTexture[0], w, h);
+	m_shared->lumaShader[target].BindShader();
+	glBindTexture(TextureTarget, TextureID);
+	DrawQuad(maxS, maxT);
+	glBindTexture(TextureTarget, 0);
+	m_shared->lumaShader[target].UnbindShader();
+
+	// Prefix sums, lines and then columns
+	// The passes only change the texture attached to the FBO
+	m_shared->satShader.BindShader();
+	m_extensions.glUniform2fARB(m_shared->satSizePassLocation, (float)w, (float)h);
+	m_extensions.glUniform1fARB(m_shared->satBiasLocation, -0.5f);
+	src = 0;
+	for(i=0; i<2; i++) {
+		for(offset=1; offset < (i == 0 ? w : h); offset *= 2) {
+			m_extensions.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, m_satTexture[1-src], 0);
+			if(i == 0)
+				m_extensions.glUniform2fARB(m_shared->satOffsetLocation, (float)offset, 0.0f);
+			else
+				m_extensions.glUniform2fARB(m_shared->satOffsetLocation, 0.0f, (float)offset);
+			glBindTexture(GL_TEXTURE_2D, m_satTexture[src]);
+			DrawQuad(maxS, maxT);
+			glBindTexture(GL_TEXTURE_2D, 0);
+			m_extensions.glUniform1fARB(m_shared->satBiasLocation, 0.0f);
+			src = 1 - src;
+		}
+	}
+	// A 1x1 table has no passes, so one pass with an offset
+	// past the edge only adds the bias
+	if(w == 1 && h == 1) {
+		m_extensions.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, m_satTexture[1-src], 0);
+		m_extensions.glUniform2fARB(m_shared->satOffsetLocation, 1.0f, 1.0f);
+		glBindTexture(GL_TEXTURE_2D, m_satTexture[src]);
+		DrawQuad(maxS, maxT);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		src = 1 - src;
+	}
+	m_shared->satShader.UnbindShader();
+	EndPass();
+
+	m_SatIndex = src;
+
+	return true;
+}
+
+//
+// Decide whether the auto threshold is estimated for this frame
+//
+// Estimates are made every "Interval" frames. Between them a small
+// probe of the frame is read back and compared with the probe at the
+// last estimate. A change of scene starts estimates on every frame
+// until the readback ring holds frames of the new scene, and the
+// result is then used without damping.
+//
+bool AutoThreshold::EstimateFrame(GLuint TextureID, GLuint TextureTarget, float maxS, float maxT)
+{
+	bool bEstimate;
+
+	if(m_SceneFrames > 0) {
+		m_SceneFrames--;
+		m_FrameCount = 0;
+		// Probe kept up to date for the next comparison
+		if(m_BudgetInterval > 1 && Probe(TextureID, TextureTarget, maxS, maxT)) {
+			memcpy((void *)m_probeRef, (const void *)m_probeLuma, PROBE_CELLS);
+			m_bProbeRef = true;
+		}
+		return true;
+	}
+
+	// Every frame is estimated without the probe
+	if(m_BudgetInterval <= 1) {
+		m_FrameCount = 0;
+		return true;
+	}
+
+	bEstimate = (++m_FrameCount >= m_BudgetInterval);
+
+	if(Probe(TextureID, TextureTarget, maxS, maxT)) {
+		if(bEstimate || !m_bProbeRef) {
+			memcpy((void *)m_probeRef, (const void *)m_probeLuma, PROBE_CELLS);
+			m_bProbeRef = true;
+		}
+		else if(SceneChange()) {
+			m_SceneFrames = NUM_PBOS;
+			bEstimate = true;
+		}
+	}
+
+	if(bEstimate)
+		m_FrameCount = 0;
+
+	return bEstimate;
+}
+
+//
+// Read back a PROBE_SIZE x PROBE_SIZE copy of the frame
+//
+// Uses a ring of buffers in the same way as the readback. Returns
+// true with the luminance of the oldest probe in m_probeLuma.
+//
+bool AutoThreshold::Probe(GLuint TextureID, GLuint TextureTarget, float maxS, float maxT)
+{
+	FFGLShader &shader = m_shared->copyShader[TargetIndex(TextureTarget)];
+	const unsigned char *pboMemory;
+	int i;
+
+	if(!shader.IsReady() || !m_probePbo[0] || !m_fbo)
+		return false;
+
+	if(!m_probeTexture) {
+		glGenTextures(1, &m_probeTexture);
+		glBindTexture(GL_TEXTURE_2D, m_probeTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PROBE_SIZE, PROBE_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		for(i=0; i<NUM_PBOS; i++) {
+			m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, m_probePbo[i]);
+			m_extensions.glBufferData(GL_PIXEL_PACK_BUFFER, PROBE_CELLS*4, NULL, GL_STREAM_READ);
+		}
+		m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		m_ProbeIndex  = 0;
+		m_ProbeFrames = 0;
+	}
+
+	BeginPass(m_probeTexture, PROBE_SIZE, PROBE_SIZE);
+	shader.BindShader();
+	glBindTexture(TextureTarget, TextureID);
+	DrawQuad(maxS, maxT);
+	glBindTexture(TextureTarget, 0);
+	shader.UnbindShader();
+	EndPass();
+
+	// Queue the read of the probe
+	glBindTexture(GL_TEXTURE_2D, m_probeTexture);
+	m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, m_probePbo[m_ProbeIndex]);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	m_ProbeIndex = (m_ProbeIndex+1)%NUM_PBOS;
+	if(m_ProbeFrames < NUM_PBOS)
+		m_ProbeFrames++;
+	if(m_ProbeFrames < NUM_PBOS)
+		return false;
+
+	// Map the oldest probe
+	m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, m_probePbo[m_ProbeIndex]);
+	pboMemory = (const unsigned char *)m_extensions.glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if(pboMemory) {
+		for(i=0; i<PROBE_CELLS; i++)
+			m_probeLuma[i] = (unsigned char)ThresholdStats::Luma(pboMemory + i*4);
+		m_extensions.glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return (pboMemory != NULL);
+}
+
+// The probe differs from the one at the last estimate
+// by more than SCENE_CHANGE luminance levels on average
+bool AutoThreshold::SceneChange()
+{
+	int i, d, sum;
 
-	// Bind buffer
-	m_extensions.glBindBuffer (GL_PIXEL_PACK_BUFFER, pboID1);
+	sum = 0;
+	for(i=0; i<PROBE_CELLS; i++) {
+		d = (int)m_probeLuma[i] - (int)m_probeRef[i];
+		sum += (d < 0) ? -d : d;
+	}
+
+	return (sum > SCENE_CHANGE*PROBE_CELLS);
+}
+
+// Statistics needed by the method and the threshold from them
+// With posterised levels the histogram is made in the same pass
+// and the level thresholds are published as multiples of the threshold
+// Called by the GL thread or by the background worker, never both
+// at once, so the incremental option is changed here
+void AutoThreshold::EstimateView(const ImageView &view, int stride, int method, int levels, bool bIncremental)
+{
+	float thresholds[MAX_LEVELS-1];
+	float scale[MAX_LEVELS-1];
+	float threshold;
+	int i;
+
+	if(m_estimator.GetIncremental() != bIncremental)
+		m_estimator.SetIncremental(bIncremental);
+
+	if(levels <= 2) {
+		PublishThreshold(m_estimator.estimate(view, stride, method, m_stats));
+		return;
+	}
+
+	threshold = m_estimator.estimateLevels(view, stride, method, levels, thresholds, m_stats);
+	for(i=0; i<levels-1; i++) {
+		if(threshold > 0.0f)
+			scale[i] = thresholds[i]/threshold;
+		else
+			scale[i] = 2.0f*(float)(i+1)/(float)levels;
+	}
+	PublishThreshold(threshold, levels, scale);
+}
+
+// Hand a new estimate to the GL thread
+// Called by the GL thread or by the background worker
+void AutoThreshold::PublishThreshold(float threshold, int levels, const float *scale)
+{
+	for(int i=0; scale && i<levels-1; i++)
+		m_NewLevelScale[i] = scale[i];
+	m_NewLevels = scale ? levels : 0;
+	m_NewThreshold = threshold;
+	m_bNewThreshold = true;
+	m_PublishCount++;
+}
+
+//
+// Shared estimates
+//
+// Instances with the same input and settings claim the same key.
+// The settings are those after the budget so that an instance never
+// takes on the quality or cadence of another.
+// Returns true if this instance makes the estimates. The others
+// read them from the cache and smooth them with their own damping.
+//
+bool AutoThreshold::ClaimEstimate(const FFGLTextureStruct &Texture, int levels)
+{
+	EstimateKey key;
+
+	// The cache only holds the threshold, so an instance
+	// with posterised levels makes its own estimates
+	if(levels > 2) {
+		if(m_estimateKey.context) {
+			EstimateCache::Remove(this);
+			memset((void *)&m_estimateKey, 0, sizeof(EstimateKey));
+		}
+		m_bEstimateOwner = false;
+		return true;
+	}
+
+	memset((void *)&key, 0, sizeof(EstimateKey));
+	key.context     = m_shared->context;
+	key.texture     = Texture.Handle;
+	key.width       = Texture.Width;
+	key.height      = Texture.Height;
+	key.method      = m_Method;
+	key.decimation  = m_BudgetDecimation;
+	key.stride      = m_BudgetStride;
+	key.interval    = m_BudgetInterval;
+	key.incremental = m_Incremental;
+	key.luma        = m_Luma;
+	key.mask        = m_MaskHandle;
+	RegionOfInterest(Texture.Width, Texture.Height, key.roi);
+
+	// Settings or input changed, so let go of the last key
+	if(memcmp((const void *)&key, (const void *)&m_estimateKey, sizeof(EstimateKey)) != 0) {
+		EstimateCache::Remove(this);
+		m_estimateKey = key;
+		m_SharedCount = 0;
+	}
+
+	m_bEstimateOwner = EstimateCache::Claim(m_estimateKey, this, m_EstimateFrame);
+
+	return m_bEstimateOwner;
+}
+
+// Hand the latest estimate of the owner to the cache
+// Estimates of the worker are shared by the next frame
+void AutoThreshold::ShareEstimate()
+{
+	unsigned int count = m_PublishCount.load();
+
+	if(count == m_SharedPublish)
+		return;
+
+	m_SharedPublish = count;
+	EstimateCache::Publish(m_estimateKey, this, m_NewFrame.load(), m_NewThreshold.load(), m_SceneFrames > 0);
+}
+
+//
+// Temporal smoothing of the auto threshold
+//
+// An exponential average with "Damping" and a small dead band so
+// that noise does not move the threshold. After a change of scene
+// the estimate is used directly.
+//
+void AutoThreshold::SmoothThreshold(float threshold)
+{
+	float current = m_AutoThreshold.load();
+	float d = threshold - current;
+
+	if(m_Damping <= 0.0f || m_SceneFrames > 0 || current <= 0.0f) {
+		m_AutoThreshold = threshold;
+		return;
+	}
+
+	if(fabs(d) < THRESHOLD_HYSTERESIS)
+		return;
+
+	m_AutoThreshold = current + d*(1.0f - m_Damping*MAX_DAMPING);
+}
+
+// Level thresholds of a new estimate smoothed in with the same damping
+// New levels or a change of scene are used directly
+void AutoThreshold::SmoothLevels()
+{
+	int levels = m_NewLevels.load();
+	float scale;
+	int i;
+
+	for(i=0; i<levels-1; i++) {
+		scale = m_NewLevelScale[i].load();
+		if(levels != m_ScaleLevels || m_Damping <= 0.0f || m_SceneFrames > 0)
+			m_LevelScale[i] = scale;
+		else
+			m_LevelScale[i] += (scale - m_LevelScale[i])*(1.0f - m_Damping*MAX_DAMPING);
+	}
+	m_ScaleLevels = levels;
+}
+
+// Buffer for the readback pixels
+// Kept between frames and only re-allocated when a larger size is needed.
+// Aligned to a cache line for the estimators.
+unsigned char *AutoThreshold::AllocateImage(unsigned int size)
+{
+	if(size > m_ImageSize || !image) {
+		FreeImage();
+		image = (unsigned char *)_aligned_malloc(size, 64);
+		if(image)
+			m_ImageSize = size;
+	}
+	return image;
+}
+
+void AutoThreshold::FreeImage()
+{
+	if(image) _aligned_free((void *)image);
+	image = NULL;
+	m_ImageSize = 0;
+}
+
+// All this is so that the process does not stall OpenGL
+//
+// The texture is read into the next PBO of a ring.
+// Returns true when the oldest PBO of the ring holds a frame.
+// With 1 byte per pixel only the red channel is read.
+// The region read starts at x, y from the bottom left.
+//
+bool AutoThreshold::ReadTexture(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, int bytes, unsigned int x, unsigned int y)
+{
+	GLint alignment;
+	int i;
+
+	if(!m_pbo[0] || !m_fbo)
+		return false;
+
+	// GL_PIXEL_PACK_BUFFER_ARB is for transferring pixel data from OpenGL to your application,
+	// and GL_PIXEL_UNPACK_BUFFER_ARB means transferring pixel data from an application to OpenGL.
+	// OpenGL refers to these tokens to determine the best memory space of a PBO, for example,
+	// a video memory for uploading (unpacking) textures, or system memory for reading (packing)
+	// the framebuffer.
 
 	// If you specify a NULL pointer to the source array in glBufferDataARB(), 
 	// then PBO allocates only a memory space with the given data size. 
@@ -614,293 +2538,412 @@ bool AutoThreshold::LoadFromTexture(GLuint TextureID, GLuint TextureTarget, unsi
 	// GL_STREAM_DRAW_ARB is for streaming texture upload and GL_STREAM_READ_ARB
 	// is for asynchronous framebuffer read-back. 
 
-	
-	// Note that glMapBufferARB() causes sync issue.
-	// If GPU is working with this buffer, glMapBufferARB() will wait(stall)
-	// until GPU to finish its job. To avoid waiting (idle), you can call
-	// first glBufferDataARB() with NULL pointer before glMapBufferARB().
-	// If you do that, the previous data in PBO will be discarded and
-	// glMapBufferARB() returns a new allocated pointer immediately
-	// even if GPU is still working with the previous data.
-	// LJ noted a vsync problem full screen - cured by setting NVIDIA "adaptive"
-	m_extensions.glBufferData(GL_PIXEL_PACK_BUFFER, width*height*4, NULL, GL_STREAM_READ);
+	// Storage is only re-allocated when the texture size or format changes.
+	// Frames held in the ring are then invalid and it has to fill again.
+	if(width != m_PboWidth || height != m_PboHeight || bytes != m_PboBytes) {
+		for(i=0; i<NUM_PBOS; i++) {
+			m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbo[i]);
+			m_extensions.glBufferData(GL_PIXEL_PACK_BUFFER, width*height*bytes, NULL, GL_STREAM_READ);
+		}
+		m_extensions.glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		m_PboWidth  = width;
+		m_PboHeight = height;
+		m_PboBytes  = bytes;
+		m_PboIndex  = 0;
+		m_PboFrames = 0;
+	}
+
+	// Bind the next buffer of the ring
+	m_extensions.glBindBuffer (GL_PIXEL_PACK_BUFFER, m_pbo[m_PboIndex]);
 
 	// while PBO is still bound, transfer the data from the texture to the PBO
-	m_extensions.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, tempFBO); 
+	// This is queued by the GPU and returns immediately
+	m_extensions.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, m_fbo); 
 	m_extensions.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, TextureTarget, TextureID, 0);
-	glReadPixels(0, 0, width, height, GL_RGBA,  GL_UNSIGNED_BYTE, 0);
-	m_extensions.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	double readStart = ProfileStart();
+	bool bQuery = BeginQuery(PROFILE_GPU_READ);
+	if(bytes == 1) {
+		// Lines of single bytes are not padded to 4
+		glGetIntegerv(GL_PACK_ALIGNMENT, &alignment);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(x, y, width, height, GL_RED, GL_UNSIGNED_BYTE, 0);
+		glPixelStorei(GL_PACK_ALIGNMENT, alignment);
+	}
+	else {
+		glReadPixels(x, y, width, height, GL_RGBA,  GL_UNSIGNED_BYTE, 0);
+	}
+	if(bQuery) EndQuery(PROFILE_GPU_READ);
+	ProfileEnd(PROFILE_READBACK, readStart);
+	m_extensions.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, TextureTarget, 0, 0);
+	m_extensions.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, m_HostFBO);
 	m_extensions.glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
 
-	// To download data to the CPU, bind the buffer to the GL_PIXEL_UNPACK_BUFFER target
-	// using glBindBufferARB(). The glTexImage2D() command will then unpack (read) their data
-	// from the buffer object. 
+	// The next index is now the oldest buffer in the ring
+	m_PboIndex = (m_PboIndex+1)%NUM_PBOS;
+	if(m_PboFrames < NUM_PBOS)
+		m_PboFrames++;
 
-	// Now bind for readback
-	m_extensions.glBindBuffer (GL_PIXEL_UNPACK_BUFFER, pboID1);
+	// Wait until the oldest buffer has been written
+	return (m_PboFrames >= NUM_PBOS);
 
-	pboMemory = m_extensions.glMapBuffer (GL_PIXEL_UNPACK_BUFFER, GL_READ_ONLY);
+}
 
-	// Read the data from PBO memory into the CPU buffer
-	CopyMemory((void *)data, pboMemory, width*height*4);
+//
+// Read the texture into the PBO ring and map the PBO that was written
+// NUM_PBOS-1 frames ago. By then the GPU has finished with it and the
+// map does not wait. Returns false until the ring has filled.
+// The view is valid until UnmapTexture is called.
+//
+bool AutoThreshold::MapTexture(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, ImageView &view, int bytes, unsigned int x, unsigned int y)
+{
+	void *pboMemory;
 
-	// Unmap buffer, indicating we are done reading data from it
-	m_extensions.glUnmapBuffer (GL_PIXEL_UNPACK_BUFFER);
+	if(!ReadTexture(TextureID, TextureTarget, width, height, bytes, x, y))
+		return false;
 
-	// Unbind buffer
-	m_extensions.glBindBuffer (GL_PIXEL_UNPACK_BUFFER, 0);
+	// Note that glMapBufferARB() causes sync issue.
+	// If GPU is working with this buffer, glMapBufferARB() will wait(stall)
+	// until GPU to finish its job. The oldest buffer in the ring was
+	// written NUM_PBOS-1 frames ago so the GPU should be done with it.
+	// LJ noted a vsync problem full screen - cured by setting NVIDIA "adaptive"
+	m_extensions.glBindBuffer (GL_PIXEL_PACK_BUFFER, m_pbo[m_PboIndex]);
+
+	double mapStart = ProfileStart();
+	pboMemory = m_extensions.glMapBuffer (GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	ProfileEnd(PROFILE_MAP, mapStart);
+	if(!pboMemory) {
+		m_extensions.glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+		return false;
+	}
 
-	if(pboID1) m_extensions.glDeleteBuffers(1, &pboID1);
-	if(tempFBO) m_extensions.glDeleteFramebuffersEXT(1, &tempFBO);
+	// The buffer stays bound until it is unmapped
+	view.data   = (const unsigned char *)pboMemory;
+	view.width  = (int)width;
+	view.height = (int)height;
+	view.pitch  = (int)width*bytes;
+	view.bytes  = bytes;
+	view.mask   = 0;
 
 	return true;
 
 }
 
+void AutoThreshold::UnmapTexture()
+{
+	// Unmap buffer, indicating we are done reading data from it
+	m_extensions.glBindBuffer (GL_PIXEL_PACK_BUFFER, m_pbo[m_PboIndex]);
+	m_extensions.glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+
+	// Unbind buffer
+	m_extensions.glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+}
+
 //
-// requires an RGBA image
+// Background estimator
 //
-// Looks at the variance around sampled pixels
+// The GL thread copies the readback into the image buffer and hands it
+// over. The worker publishes the result in m_AutoThreshold which the
+// next frame reads. Nothing waits for the worker except DeInitGL.
 //
-// TODO - more efficient
-float AutoThreshold::gradient (unsigned char *buffer, int Width,  int Height)
+void AutoThreshold::SubmitWorker(const ImageView &view, int stride, int method, int levels, bool bIncremental)
 {
-	
-	int i, t;
-	int left, right;
-	int top, bot, mid, j;
-	int ex, ey, exy;
-	int sum_lo, sum_hi, sum_exy_lo, sum_exy_hi;
-	double sum_exy_fxy, sum_exy;
-	unsigned char *linePtr;
-	unsigned char *lp;
+	std::lock_guard<std::mutex> lock(m_workerMutex);
 
-	sum_exy_lo  = 0;
-	sum_exy_hi  = 0;
-	sum_lo      = 0;
-	sum_hi      = 0;
-	sum_exy_fxy = 0;
-	sum_exy     = 0;
+	// Started when first needed
+	if(!m_worker.joinable()) {
+		m_workerQuit = false;
+		m_worker = std::thread(&AutoThreshold::WorkerThread, this);
+	}
 
-	lp = buffer; // local pointer
+	m_workerView    = view;
+	m_workerStride  = stride;
+	m_workerMethod  = method;
+	m_workerLevels  = levels;
+	m_workerIncremental = bIncremental;
+	m_workerFrame   = m_EstimateFrame;
+	m_workerPending = true;
+	m_workerBusy    = true;
+	m_workerWake.notify_one();
+}
 
-	for(i=4; i<Height-4; i+=4) { // every fourth line for speed
+// Wait until the worker has finished with the image buffer
+void AutoThreshold::WaitWorker()
+{
+	std::unique_lock<std::mutex> lock(m_workerMutex);
+	m_workerIdle.wait(lock, [this] { return !m_workerBusy; });
+}
 
-		linePtr = buffer + i*(Width *4); // start of the line
+void AutoThreshold::StopWorker()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_workerMutex);
+		m_workerQuit = true;
+	}
+	m_workerWake.notify_one();
+	if(m_worker.joinable())
+		m_worker.join();
+}
 
-		for(j=4; j<Width-4; j+=4) { // every fourth column for speed
+void AutoThreshold::WorkerThread()
+{
+	ImageView view;
+	int stride, method, levels;
+	bool bIncremental;
+	unsigned int frame;
+
+	std::unique_lock<std::mutex> lock(m_workerMutex);
+	for(;;) {
+		m_workerWake.wait(lock, [this] { return m_workerQuit || m_workerPending; });
+		if(m_workerQuit)
+			break;
+		view   = m_workerView;
+		stride = m_workerStride;
+		method = m_workerMethod;
+		levels = m_workerLevels;
+		bIncremental = m_workerIncremental;
+		frame = m_workerFrame;
+		m_workerPending = false;
+		lock.unlock();
+
+		double estimateStart = ProfileStart();
+		double workerStart = ProfileClock();
+		m_NewFrame = frame;
+		EstimateView(view, stride, method, levels, bIncremental);
+		m_WorkerTime = (float)(ProfileClock() - workerStart);
+		ProfileEnd(PROFILE_ESTIMATE, estimateStart);
+
+		lock.lock();
+		m_workerBusy = false;
+		m_workerIdle.notify_all();
+	}
+	m_workerBusy = false;
+	m_workerIdle.notify_all();
+}
 
-			lp = linePtr + j*4; // start of the pixel
+//
+// Profile
+//
+// CPU times are taken with a high resolution clock. GPU times come
+// from GL_TIME_ELAPSED queries in a ring so that a result is read
+// NUM_PBOS-1 frames later and nothing waits for the GPU. Results not
+// ready by then are dropped. Nothing is timed while the option is off.
+//
 
-			// neighbours
-			// Move across the line 4 pixels at a time
-			// Pointer starts at R (*)
-			//
-			// [R G B A][R G B A][R G B A]
-			// [R G B A][* G B A][R G B A]
-			// [R G B A][R G B A][R G B A]
-			//
-			// Left
-			left =  0;
-			left += (int)*(lp-4); // R
-			left += (int)*(lp-3); // G
-			left += (int)*(lp-2); // B
+// Milliseconds from a high resolution clock
+static double ProfileClock()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-			// Centre
-			mid =  0;
-			mid += (int)*(lp  ); // R
-			mid += (int)*(lp+1); // G
-			mid += (int)*(lp+2); // B
+// The log is shared by all instances. It is opened by the first to
+// profile and closed by the last. Each block is written under
+// s_logMutex and each line starts with the instance that wrote it.
+static std::mutex s_logMutex;
+static FILE *s_logFile = NULL;
+static int s_logUsers = 0;
 
-			// Right
-			right = 0;
-			right += (int)*(lp+4); // R
-			right += (int)*(lp+5); // G
-			right += (int)*(lp+6); // B
+static FILE *OpenProfileLog()
+{
+	char path[MAX_PATH];
+	DWORD n;
+
+	std::lock_guard<std::mutex> lock(s_logMutex);
+	if(!s_logFile) {
+		n = GetTempPathA(MAX_PATH, path);
+		if(n == 0 || n > MAX_PATH-32)
+			path[0] = 0;
+		strcat(path, "AutoThreshold.log");
+		s_logFile = fopen(path, "a");
+		if(!s_logFile)
+			return NULL;
+	}
+	s_logUsers++;
 
-			// Top
-			top = 0;
-			top += (int)*(lp-Width*4  );
-			top += (int)*(lp-Width*4+1);
-			top += (int)*(lp-Width*4+2);
+	return s_logFile;
+}
 
-			// Bot
-			bot = 0;
-			top += (int)*(lp+Width*4  );
-			top += (int)*(lp+Width*4+1);
-			top += (int)*(lp+Width*4+2);
+static void CloseProfileLog()
+{
+	std::lock_guard<std::mutex> lock(s_logMutex);
+	if(--s_logUsers > 0)
+		return;
+	if(s_logFile)
+		fclose(s_logFile);
+	s_logFile = NULL;
+	s_logUsers = 0;
+}
 
-			// calculate variance of neighbourhood
-			ex           = abs(left - right);
-			ey           = abs(top - bot);
-			exy          = MAX(ex, ey);
-			sum_exy      = sum_exy + (double)exy;
-			sum_exy_fxy  = sum_exy_fxy + (double)(exy*mid);
+// Called by the GL thread between frames
+void AutoThreshold::StartProfile()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_profileMutex);
+		memset((void *)m_profile, 0, sizeof(m_profile));
+	}
+	m_ProfileFrames = 0;
 
-		} // end of all pixels in this line
+	if(m_extensions.ARB_timer_query && !m_queries[0][0])
+		m_extensions.glGenQueries(NUM_GPU_PROFILE*NUM_PBOS, &m_queries[0][0]);
+	memset((void *)m_QueryIndex, 0, sizeof(m_QueryIndex));
+	memset((void *)m_QueryFrames, 0, sizeof(m_QueryFrames));
 
-	} // end of all lines
+	if(!m_profileFile)
+		m_profileFile = OpenProfileLog();
 
-	// Calculate the threshold
-	t = 0;
-	sum_exy = sum_exy + (double)1.0;
-	t = (int)(sum_exy_fxy/sum_exy);
+	m_bProfile = true;
+}
 
-	return (float)t/(3*256); // 256 levels and RGB pixels
+void AutoThreshold::StopProfile()
+{
+	m_bProfile = false;
 
-} // end gradient
+	if(m_queries[0][0])
+		m_extensions.glDeleteQueries(NUM_GPU_PROFILE*NUM_PBOS, &m_queries[0][0]);
+	memset((void *)m_queries, 0, sizeof(m_queries));
 
+	if(m_profileFile)
+		CloseProfileLog();
+	m_profileFile = NULL;
+}
 
-//
-// TODO - luminance
-//
-void AutoThreshold::histo(unsigned char *buffer, int Width,  int Height, unsigned short histogram[256])
+// Start time of a stage or 0 if not profiling
+double AutoThreshold::ProfileStart()
 {
-	int i, j, k;
-	unsigned char *linePtr;
-	unsigned char *lp;
-
-	memset((void *)histogram, 0, 256*sizeof(unsigned short));
-
-	for(i=0; i<Height; i++) { // every fourth line for speed
-		linePtr = buffer + i*(Width *4); // start of the line
-		for(j=0; j<Width; j++) { // every fourth column for speed
-			lp = linePtr + j*4; // start of the pixel
-			// [R G B A]
-			k  = (int)*lp++; // R
-			k += (int)*lp++; // G
-			k += (int)*lp;   // B
-			histogram[k/3]++;
-		}
-	}
+	if(!m_bProfile)
+		return 0.0;
+	return ProfileClock();
 }
 
+void AutoThreshold::ProfileEnd(int stage, double start)
+{
+	if(m_bProfile)
+		AddProfile(stage, (float)(ProfileClock() - start));
+}
 
+void AutoThreshold::AddProfile(int stage, float ms)
+{
+	std::lock_guard<std::mutex> lock(m_profileMutex);
+	ProfileStage &p = m_profile[stage];
 
-/**
-* Automatic thresholding technique based on the entopy of the histogram.
-* See: P.K. Sahoo, S. Soltani, K.C. Wong and, Y.C. Chen "A Survey of
-* Thresholding Techniques", Computer Vision, Graphics, and Image Processing
-* Vol. 41, pp.233-260, 1988.
-*/
-int AutoThreshold::entropySplit(unsigned short histogram[256])
-{
-    double hist[256];
-    double normalizedHist[256];
-    double pT[256];
-    double hB[256];
-    double hW[256];
-    double sum;
-    double epsilon;
-    double hhB;
-    double pTW;
-    double hhW;
-    double djMax;
-    double dj;
-    int i, t, tMax;
-
-    // Build floating point histogram
-    for(i=0; i<256; i++)
-      hist[i] = (double)histogram[i];
-
-    // Normalize histogram, that is makes the sum of all bins equal to 1.
-    sum = 0;
-    for(i=0; i<256; i++)
-     sum += hist[i];
-
-    // This should not normally happen, but...
-    if(sum == 0)
-     return 0;
-
-    for(i=0; i<256; i++)
-      normalizedHist[i] = hist[i] / sum;
-
-    pT[0] = normalizedHist[0];
-    for(i=1; i<256; i++)
-      pT[i] = pT[i-1] + normalizedHist[i];
-
-    // Entropy for black and white parts of the histogram
-    epsilon = 0.0;
-    for(t=0; t<256; t++) {
-      // Black entropy
-      if (pT[t] > epsilon) {
-        hhB = 0;
-        for(i=0; i<=t; i++) {
-          if (normalizedHist[i] > epsilon) {
-            hhB -= normalizedHist[i] / pT[t] * log(normalizedHist[i] / pT[t]);
-          }
-        }
-        hB[t] = hhB;
-      } else {
-        hB[t] = 0;
-      }
-
-      // White  entropy
-      pTW = 1 - pT[t];
-      if (pTW > epsilon) {
-        hhW = 0;
-        for(i=t+1; i<256; i++) {
-          if (normalizedHist[i] > epsilon) {
-            hhW -= normalizedHist[i] / pTW * log(normalizedHist[i] / pTW);
-          }
-        }
-        hW[t] = hhW;
-      } else {
-        hW[t] = 0;
-      }
-    } // end for all histogram
-
-    // Find histogram index with maximum entropy
-    djMax = hB[0] + hW[0];
-    tMax = 0;
-    for(t=1; t<256; t++) {
-      dj = hB[t] + hW[t];
-      if(dj > djMax) {
-        djMax = dj;
-        tMax = t;
-      }
-    }
-    return tMax;
-}
-
-//
-int AutoThreshold::otsu(int Width, int Height, unsigned short hist[256])
-{
-	double prob[256], omega[256]; // prob of graylevels
-	double myu[256];   // mean value for separation
-	double max_sigma, sigma[256]; // inter-class variance
-	int i; // , x, y; // Loop variable
-	int threshold; // threshold for binarization
-  
-	// calculation of probability density 
-	for ( i = 0; i < 256; i ++ ) {
-		prob[i] = (double)hist[i] / (Width * Height);
+	p.time[p.next] = ms;
+	p.next = (p.next+1)%PROFILE_SAMPLES;
+	if(p.count < PROFILE_SAMPLES)
+		p.count++;
+}
+
+// Returns true if a query was started for a GPU stage
+bool AutoThreshold::BeginQuery(int stage)
+{
+	int g = stage - PROFILE_GPU_DRAW;
+
+	if(!m_bProfile || !m_queries[g][0])
+		return false;
+
+	m_extensions.glBeginQuery(GL_TIME_ELAPSED, m_queries[g][m_QueryIndex[g]]);
+
+	return true;
+}
+
+// End the query and add the time of the oldest one in the ring
+void AutoThreshold::EndQuery(int stage)
+{
+	int g = stage - PROFILE_GPU_DRAW;
+	GLuint available, ns;
+
+	m_extensions.glEndQuery(GL_TIME_ELAPSED);
+
+	m_QueryIndex[g] = (m_QueryIndex[g]+1)%NUM_PBOS;
+	if(m_QueryFrames[g] < NUM_PBOS)
+		m_QueryFrames[g]++;
+	if(m_QueryFrames[g] < NUM_PBOS)
+		return;
+
+	available = 0;
+	m_extensions.glGetQueryObjectuiv(m_queries[g][m_QueryIndex[g]], GL_QUERY_RESULT_AVAILABLE, &available);
+	if(available) {
+		m_extensions.glGetQueryObjectuiv(m_queries[g][m_QueryIndex[g]], GL_QUERY_RESULT, &ns);
+		AddProfile(stage, (float)ns*1.0e-6f);
 	}
-  
-	// omega & myu generation
-	omega[0] = prob[0];
-	myu[0] = 0.0;       // 0.0 times prob[0] equals zero
-	for (i = 1; i < 256; i++) {
-		omega[i] = omega[i-1] + prob[i];
-		myu[i] = myu[i-1] + i*prob[i];
+}
+
+// Minimum, average and 99th percentile of each stage every PROFILE_SAMPLES frames
+void AutoThreshold::LogProfile()
+{
+	float times[PROFILE_SAMPLES];
+	double sum;
+	int i, k, n;
+
+	if(++m_ProfileFrames < PROFILE_SAMPLES || !m_profileFile)
+		return;
+	m_ProfileFrames = 0;
+
+	std::lock_guard<std::mutex> lock(m_profileMutex);
+	std::lock_guard<std::mutex> logLock(s_logMutex);
+	fprintf(m_profileFile, "%p AutoThreshold          min       avg       p99 ms\n", (void *)this);
+	for(i=0; i<NUM_PROFILE; i++) {
+		n = m_profile[i].count;
+		if(n == 0)
+			continue;
+		memcpy((void *)times, (const void *)m_profile[i].time, n*sizeof(float));
+		std::sort(times, times+n);
+		sum = 0.0;
+		for(k=0; k<n; k++)
+			sum += times[k];
+		fprintf(m_profileFile, "%p   %-10s (%3d) %9.3f %9.3f %9.3f\n", (void *)this, s_profileNames[i], n,
+				times[0], sum/n, times[(n*99 + 99)/100 - 1]);
 	}
-  
-	// sigma maximization
-	// sigma stands for inter-class variance 
-	// and determines optimal threshold value
-	threshold = 0;
-	max_sigma = 0.0;
-	for (i = 0; i < 256-1; i++) {
-		if (omega[i] != 0.0 && omega[i] != 1.0)
-			sigma[i] = pow(myu[256-1]*omega[i] - myu[i], 2) / (omega[i]*(1.0 - omega[i]));
-		else
-			sigma[i] = 0.0;
-		if (sigma[i] > max_sigma) {
-			max_sigma = sigma[i];
-			threshold = i;
-		}
+	fflush(m_profileFile);
+}
+
+//
+// Budget
+//
+// The CPU time of the readback and estimate on the GL thread and of
+// the worker's estimates is averaged over BUDGET_FRAMES frames. Over
+// the budget, the next level multiplies the sampling stride, the
+// decimation and the interval by the values in s_budgetLevels. Below
+// BUDGET_HEADROOM of the budget it goes back a level, so that the
+// settings return when the host has time again.
+//
+
+// Settings of the budget level for this frame
+double AutoThreshold::BudgetStart()
+{
+	const int *level = s_budgetLevels[m_BudgetLevel];
+
+	m_BudgetStride     = level[0];
+	m_BudgetDecimation = MIN(m_Decimation*level[1], MAX_DECIMATION);
+	m_BudgetInterval   = MIN(m_Interval*level[2], MAX_INTERVAL);
+
+	if(m_Budget <= 0.0f || !m_Auto)
+		return 0.0;
+
+	return ProfileClock();
+}
+
+void AutoThreshold::BudgetEnd(double start)
+{
+	double cost, budget;
+
+	if(m_Budget <= 0.0f || !m_Auto) {
+		m_BudgetLevel  = 0;
+		m_BudgetFrames = 0;
+		m_BudgetTime   = 0.0;
+		m_WorkerTime   = 0.0f;
+		return;
 	}
 
- 	return threshold;
+	m_BudgetTime += ProfileClock() - start + (double)m_WorkerTime.exchange(0.0f);
+	if(++m_BudgetFrames < BUDGET_FRAMES)
+		return;
+
+	cost   = m_BudgetTime/(double)m_BudgetFrames;
+	budget = (double)(m_Budget*MAX_BUDGET);
+	if(cost > budget && m_BudgetLevel < NUM_BUDGET_LEVELS-1)
+		m_BudgetLevel++;
+	else if(cost < budget*BUDGET_HEADROOM && m_BudgetLevel > 0)
+		m_BudgetLevel--;
 
+	m_BudgetFrames = 0;
+	m_BudgetTime   = 0.0;
 }
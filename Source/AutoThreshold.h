@@ -4,14 +4,106 @@
 #include <FFGLShader.h>
 #include "../FFGLPluginSDK.h"
 #include <math.h>
+#include <stdio.h>
+#include "ThresholdStats.h"
+#include "SharedResources.h"
 // #include "histogram_ext.h"
 
+// Number of pixel pack buffers in the readback ring.
+// The frame read back is mapped NUM_PBOS-1 frames later
+// so that the map does not wait for the GPU.
+#define NUM_PBOS 3
+
+// Uniforms to be loaded when they have changed
+#define UNIFORM_SMOOTHNESS 1
+#define UNIFORM_COLOR1     2
+#define UNIFORM_COLOR2     4
+#define UNIFORM_TEXSCALE   8
+#define UNIFORM_SAT        16 // summed area table size and radius
+#define UNIFORM_LEVELS     32
+#define UNIFORM_ALL        63
+
+// Values of the uniforms that follow the frame rather than a parameter
+// TexScale 2, SatSize 2, Radius 1, Levels 1 and LevelScale 3
+#define UNIFORM_FRAME_VALUES 9
+
+// Parameters of the plugin, FFPARAM_ in AutoThreshold.cpp
+#define NUM_PARAMS 31
+
+// Auto threshold every 1 to MAX_INTERVAL frames
+#define MAX_INTERVAL 16
+
+// Largest readback size divisor
+#define MAX_DECIMATION 8
+
+// Budget of 1 is MAX_BUDGET msec of auto threshold each frame
+// The cost is averaged over BUDGET_FRAMES frames before the level
+// changes and a level is given back below BUDGET_HEADROOM of it
+#define MAX_BUDGET        10.0f
+#define BUDGET_FRAMES     30
+#define BUDGET_HEADROOM   0.4
+#define NUM_BUDGET_LEVELS 7
+
+// Damping of 1 keeps this fraction of the last threshold each estimate
+#define MAX_DAMPING 0.95f
+
+// Changes of threshold smaller than this are ignored when damped
+#define THRESHOLD_HYSTERESIS 0.004f
+
+// Scene change probe of PROBE_SIZE x PROBE_SIZE pixels
+// A scene change is an average difference over SCENE_CHANGE levels
+#define PROBE_SIZE   16
+#define PROBE_CELLS  (PROBE_SIZE*PROBE_SIZE)
+#define SCENE_CHANGE 24
+
+// Tiles across and down the frame for the adaptive mode
+#define ADAPTIVE_GRID 8
+
+// The summed area table of the local mode is made
+// at the input size divided by SAT_DIVISOR
+// Radius is up to MAX_RADIUS texels of the table
+#define SAT_DIVISOR 2
+#define MAX_RADIUS  64
+
+// Entries of the lookup table for B&W and two tone
+// and the settings it is made from
+#define LUT_SIZE 1024
+#define LUT_KEYS 15
+
+// Smallest region of interest in pixels
+#define MIN_ROI 32
+
+// Inputs, the second is an optional mask for auto threshold
+#define NUM_INPUTS 2
+
+// Stages timed by the Profile option
+#define PROFILE_DRAW     0 // CPU time
+#define PROFILE_READBACK 1
+#define PROFILE_MAP      2
+#define PROFILE_COPY     3
+#define PROFILE_ESTIMATE 4
+#define PROFILE_GPU_DRAW 5 // GPU time from timer queries
+#define PROFILE_GPU_READ 6
+#define NUM_PROFILE      7
+#define NUM_GPU_PROFILE  2
+
+// Times are kept for the last PROFILE_SAMPLES frames
+// and written to the log every PROFILE_SAMPLES frames
+#define PROFILE_SAMPLES 120
+
+// Rolling times of one stage in milliseconds
+struct ProfileStage {
+	float time[PROFILE_SAMPLES];
+	int count; // times held
+	int next; // next to be written
+};
+
 class AutoThreshold :
 public CFreeFrameGLPlugin
 {
 public:
 	AutoThreshold();
-  virtual ~AutoThreshold() {}
+	virtual ~AutoThreshold();
 
 	///////////////////////////////////////////////////
 	// FreeFrameGL plugin methods
@@ -23,6 +115,9 @@ public:
 	DWORD InitGL(const FFGLViewportStruct *vp);
 	DWORD DeInitGL();
 
+	// Threshold the last frame was drawn with
+	float GetThreshold() const { return m_Threshold; }
+
 	///////////////////////////////////////////////////
 	// Factory method
 	///////////////////////////////////////////////////
@@ -40,11 +135,33 @@ protected:
 	// Parameters
 	float m_Threshold;
 	float m_UserThreshold;
-	float m_AutoThreshold;
+	std::atomic<float> m_AutoThreshold; // smoothed estimate
 	float m_Smoothness;
 	int   m_TwoTone;
+	int   m_Levels; // posterised two tone levels 2-MAX_LEVELS
+	float m_LevelsValue;
 	int   m_Chroma;
 	int   m_Auto;
+	int   m_Method;
+	float m_MethodValue;
+	int   m_Gpu;
+	int   m_Async;
+	int   m_Decimation; // readback size divisor 1, 2, 4 or 8
+	float m_DecimationValue;
+	int   m_Interval; // frames between estimates
+	float m_IntervalValue;
+	float m_Damping;
+	int   m_Incremental;
+	int   m_Luma; // single channel readback
+	int   m_Profile;
+	float m_Budget; // msec of auto threshold each frame 0-1
+	float m_RoiX; // region of interest 0-1 from the top left
+	float m_RoiY;
+	float m_RoiWidth;
+	float m_RoiHeight;
+	int   m_Adaptive; // threshold for each tile
+	int   m_Local; // threshold from the neighbourhood mean
+	float m_Radius;
 	
 	float m_Red1;
 	float m_Grn1;
@@ -55,35 +172,218 @@ protected:
 	float m_Grn2;
 	float m_Blu2;
 	float m_Alf2;
+
+	// Parameter block
+	// Written by SetParameter on any host thread and copied to
+	// the members above once a frame by ReadParameters
+	std::atomic<float> m_paramValue[NUM_PARAMS];
+	std::atomic<unsigned int> m_ParamSequence; // odd while a value is written
+	std::mutex m_paramMutex; // between writers
+	float m_frameValue[NUM_PARAMS]; // values applied to the members
+	unsigned int m_FrameSequence;
 	
 	int m_initResources;
 	FFGLExtensions m_extensions;
-    FFGLShader m_shader;
 
-	GLint m_thresholdLocation;
-	GLint m_smoothnessLocation;
-	GLint m_twotoneLocation;
-	GLint m_ChromaLocation;
-	
-	GLint m_red1Location;
-	GLint m_grn1Location;
-	GLint m_blu1Location;
-	GLint m_alf1Location;
-	
-	GLint m_red2Location;
-	GLint m_grn2Location;
-	GLint m_blu2Location;
-	GLint m_alf2Location;
+	// Shaders of the GL context, shared with other instances
+	SharedShaders *m_shared;
+
+	// Uniforms changed since they were loaded into each program
+	int m_UniformDirty[NUM_SHADERS];
+	float m_UniformThreshold[NUM_SHADERS]; // threshold last loaded
+	float m_UniformFrame[NUM_SHADERS][UNIFORM_FRAME_VALUES]; // frame values last loaded
 	
+	// Full screen quad
+	GLuint m_quadVbo;
+	float m_QuadS; // texture coordinates in the buffer
+	float m_QuadT;
+	float m_QuadMinS;
+	float m_QuadMinT;
+
+	// Readback
+	GLuint m_fbo;
+	GLuint m_pbo[NUM_PBOS];
+	int m_PboIndex; // next PBO to be written
+	int m_PboFrames; // number of PBOs holding frames
+	unsigned int m_PboWidth;
+	unsigned int m_PboHeight;
+	int m_PboBytes; // bytes per pixel
+	GLuint m_HostFBO; // bound again after the readback
+
+	// Render passes
+	GLint m_passViewport[4];
+	GLint m_passFbo;
+
+	// Input texture targets, found when the handle changes
+	GLuint m_InputHandle[NUM_INPUTS];
+	GLuint m_InputTarget[NUM_INPUTS];
+
+	// Mask of this frame, 0 if there is none
+	GLuint m_MaskHandle;
+	GLuint m_MaskTarget;
+	float m_MaskScaleS; // mask texture coordinates from the input
+	float m_MaskScaleT;
+
+	// Decimated and luminance readback
+	GLuint m_downTexture;
+	unsigned int m_DownWidth;
+	unsigned int m_DownHeight;
+
+	// GPU reduction
+	GLuint m_reduceTexture;
+	unsigned int m_ReduceWidth;
+	unsigned int m_ReduceHeight;
+	int m_ReduceLevel; // mip level holding the 1x1 average
+
+	// Threshold made by the GPU
+	// Two 1x1 textures, each frame mixes the last one in
+	GLuint m_thresholdTexture[2];
+	int m_ThresholdIndex; // texture holding the latest threshold
+
+	// Adaptive threshold made by the GPU
+	// Two ADAPTIVE_GRID x ADAPTIVE_GRID textures as for the threshold
+	GLuint m_tileTexture[2];
+	int m_TileIndex;
+
+	// Summed area table of luminance for the local mode
+	// Two float textures take turns for the prefix sum passes
+	GLuint m_satTexture[2];
+	int m_SatIndex; // texture holding the table
+	unsigned int m_SatWidth;
+	unsigned int m_SatHeight;
+
+	// Lookup table texture, LUT_SIZE x 1 RGBA
+	GLuint m_lutTexture;
+	float m_LutKey[LUT_KEYS]; // settings of the table
+	// Temporal smoothing
+	// New estimates are published by the GL thread or
+	// the worker and smoothed in by the next frame
+	std::atomic<float> m_NewThreshold;
+	std::atomic<unsigned int> m_NewFrame; // frame of the key it was read back in
+	std::atomic<bool> m_bNewThreshold;
+	std::atomic<float> m_NewLevelScale[MAX_LEVELS-1]; // level thresholds as multiples of the threshold
+	std::atomic<int> m_NewLevels; // levels of the new estimate, 0 for none
+	float m_LevelScale[MAX_LEVELS-1]; // smoothed
+	int m_ScaleLevels;
+	int m_FrameCount; // frames since the last estimate
+	int m_SceneFrames; // frames to estimate after a scene change
+
+	// Budget controller
+	// The level sets the stride, decimation and interval used
+	int m_BudgetLevel;
+	int m_BudgetFrames; // frames averaged
+	double m_BudgetTime; // msec of those frames
+	int m_BudgetStride; // multiplies the sampling stride
+	int m_BudgetDecimation;
+	int m_BudgetInterval;
+	std::atomic<float> m_WorkerTime; // msec of the worker's last estimate
+
+	// Estimates shared with instances that have the same input
+	EstimateKey m_estimateKey;
+	bool m_bEstimateOwner; // this instance makes the estimates
+	unsigned int m_EstimateFrame; // frame of the key at the last claim
+	unsigned int m_SharedCount; // estimates read from the owner
+	std::atomic<unsigned int> m_PublishCount; // estimates published
+	unsigned int m_SharedPublish; // estimates shared
+
+	// Scene change probe
+	GLuint m_probeTexture;
+	GLuint m_probePbo[NUM_PBOS];
+	int m_ProbeIndex;
+	int m_ProbeFrames;
+	unsigned char m_probeLuma[PROBE_CELLS]; // latest probe
+	unsigned char m_probeRef[PROBE_CELLS]; // probe at the last estimate
+	bool m_bProbeRef;
+
+	// CPU estimators
+	ThresholdStats m_estimator;
+
+	// Background estimator
+	// The readback is copied to "image" and handed to the worker.
+	// While it is busy new frames are dropped.
+	std::thread m_worker;
+	std::mutex m_workerMutex;
+	std::condition_variable m_workerWake;
+	std::condition_variable m_workerIdle;
+	std::atomic<bool> m_workerBusy;
+	bool m_workerPending;
+	bool m_workerQuit;
+	ImageView m_workerView;
+	int m_workerStride;
+	int m_workerMethod;
+	int m_workerLevels;
+	bool m_workerIncremental;
+	unsigned int m_workerFrame;
+
+	// Profile
+	// Times are only taken while m_bProfile is set by the GL thread
+	std::atomic<bool> m_bProfile;
+	ProfileStage m_profile[NUM_PROFILE];
+	std::mutex m_profileMutex; // the worker times the estimator
+	int m_ProfileFrames;
+	FILE *m_profileFile; // the shared log while this instance profiles
+	GLuint m_queries[NUM_GPU_PROFILE][NUM_PBOS]; // ring of timer queries for each GPU stage
+	int m_QueryIndex[NUM_GPU_PROFILE];
+	int m_QueryFrames[NUM_GPU_PROFILE];
+
+	void StartProfile();
+	void StopProfile();
+	double ProfileStart();
+	void ProfileEnd(int stage, double start);
+	void AddProfile(int stage, float ms);
+	bool BeginQuery(int stage);
+	void EndQuery(int stage);
+	void LogProfile();
+
+	double BudgetStart();
+	void BudgetEnd(double start);
+
+	void SubmitWorker(const ImageView &view, int stride, int method, int levels, bool bIncremental);
+	void WaitWorker();
+	void StopWorker();
+	void WorkerThread();
+
+	// Persistent readback buffer
 	unsigned char *image;
-	unsigned short m_histogram[256];
+	unsigned int m_ImageSize;
+	FrameStats m_stats;
 
-	bool LoadFromTexture(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, unsigned char *data);
-	float gradient (unsigned char *lp, int Width,  int Height);
+	unsigned char *AllocateImage(unsigned int size);
+	void FreeImage();
 
-	int entropySplit(unsigned short histogram[256]);
-	int otsu(int Width, int Height, unsigned short histogram[256]);
-	void histo(unsigned char* pix, int width, int height, unsigned short histogram[256]);
+	void CompileShaders(int target);
+	void CompileResolve();
+	void CompileMask(int target, int maskTarget);
+	GLuint InputTarget(GLuint TextureID, int input = 0);
+	static int TargetIndex(GLuint TextureTarget);
+	void SetMask(ProcessOpenGLStruct *pGL, const FFGLTexCoords &maxCoords);
+	void RegionOfInterest(unsigned int width, unsigned int height, unsigned int roi[4]);
+	void DrawQuad(float maxS, float maxT, float minS = 0.0f, float minT = 0.0f);
+	void SetUniformDirty(int flags);
+	void WriteParameter(int index, float value);
+	void ReadParameters();
+	void ApplyParameter(int index, float value);
+	float ParameterValue(int index);
+	void BeginPass(GLuint texture, unsigned int width, unsigned int height);
+	void EndPass();
+	bool Downsample(GLuint TextureID, GLuint TextureTarget, float minS, float minT, float maxS, float maxT, unsigned int width, unsigned int height, bool bLuma, bool bMask = false);
+	bool ReadTexture(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, int bytes = 4, unsigned int x = 0, unsigned int y = 0);
+	bool MapTexture(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, ImageView &view, int bytes = 4, unsigned int x = 0, unsigned int y = 0);
+	void UnmapTexture();
+	bool ReduceGradient(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, float maxS, float maxT);
+	void UpdateLut(int mode, int levels, const float scale[MAX_LEVELS-1]);
+	bool ResolveThreshold(float maxS, float maxT);
+	bool ResolveTiles();
+	bool SummedArea(GLuint TextureID, GLuint TextureTarget, unsigned int width, unsigned int height, float maxS, float maxT);
+	bool EstimateFrame(GLuint TextureID, GLuint TextureTarget, float maxS, float maxT);
+	bool Probe(GLuint TextureID, GLuint TextureTarget, float maxS, float maxT);
+	bool SceneChange();
+	void EstimateView(const ImageView &view, int stride, int method, int levels, bool bIncremental);
+	void PublishThreshold(float threshold, int levels = 2, const float *scale = NULL);
+	void SmoothThreshold(float threshold);
+	void SmoothLevels();
+	bool ClaimEstimate(const FFGLTextureStruct &Texture, int levels);
+	void ShareEstimate();
 
 
 };
@@ -0,0 +1,472 @@
+//
+//		AutoThresholdBatch.cpp
+//
+//		Offline AutoThreshold of recorded frames without a FreeFrame host
+//
+//		The plugin is created in a hidden window's GL context and given
+//		one frame after another as a real time host would, as fast as the
+//		GPU allows. Frames go up through a ring of unpack buffers and the
+//		results come back through a ring of pack buffers, so that reading
+//		frame N+1, drawing frame N and writing frame N-2 overlap. The GL
+//		commands of several frames are submitted together, and with
+//		Async=1 the next frame's threshold is estimated while the GPU draws.
+//
+//		Frames are raw RGBA, 4 bytes per pixel, concatenated in one file.
+//		"-" is the standard input or output so that a decoder and encoder
+//		can be piped through it :
+//
+//			AutoThresholdBatch width height input output [-check] [name=value] ...
+//
+//			ffmpeg -i in.mp4 -f rawvideo -pix_fmt rgba - |
+//			AutoThresholdBatch 1920 1080 - - Auto=1 TwoTone=1 |
+//			ffmpeg -f rawvideo -pix_fmt rgba -s 1920x1080 -i - out.mp4
+//
+//		Parameters are named as shown by the host, ignoring spaces and case,
+//		with values 0-1. Frames are uploaded top line first, so "ROI Y" is
+//		from the bottom of the picture. As in a host the auto threshold of
+//		a frame comes from the frames read back before it.
+//
+//		With -check each frame is also drawn by a second instance with
+//		Auto=0 and the threshold the first one used, and the two results
+//		must be the same. This is for the CPU auto threshold with two
+//		levels, where the threshold is the only difference.
+//
+//		Built from this folder with the plugin sources and the FreeFrame SDK
+//		sources that the plugin is built with, and opengl32, user32 and gdi32.
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#include <FFGL.h>
+#include <FFGLLib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <io.h>
+#include <fcntl.h>
+#include <chrono>
+#include "../AutoThreshold.h"
+
+// Frames in flight between upload and the write of the result
+#define BATCH_RING 3
+
+// Frames drawn between submissions to the GPU
+#define BATCH_FRAMES 4
+
+struct BatchContext {
+	HWND window;
+	HDC dc;
+	HGLRC context;
+};
+
+struct BatchBuffers {
+	unsigned int width;
+	unsigned int height;
+	unsigned int size; // bytes of a frame
+	GLuint input[BATCH_RING]; // input textures
+	GLuint output[BATCH_RING]; // plugin results
+	GLuint upload[BATCH_RING]; // unpack buffers
+	GLuint download[BATCH_RING]; // pack buffers
+	GLuint check; // result of the Auto=0 instance for -check
+	GLuint fbo;
+};
+
+// Hidden window with a GL context made current
+static bool CreateContext(BatchContext &ctx)
+{
+	PIXELFORMATDESCRIPTOR pfd;
+	int format;
+
+	memset((void *)&ctx, 0, sizeof(BatchContext));
+	ctx.window = CreateWindowA("STATIC", "AutoThresholdBatch", WS_POPUP, 0, 0, 16, 16, NULL, NULL, GetModuleHandle(NULL), NULL);
+	if(!ctx.window)
+		return false;
+	ctx.dc = GetDC(ctx.window);
+
+	memset((void *)&pfd, 0, sizeof(PIXELFORMATDESCRIPTOR));
+	pfd.nSize      = sizeof(PIXELFORMATDESCRIPTOR);
+	pfd.nVersion   = 1;
+	pfd.dwFlags    = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+	pfd.iPixelType = PFD_TYPE_RGBA;
+	pfd.cColorBits = 32;
+	format = ChoosePixelFormat(ctx.dc, &pfd);
+	if(!format || !SetPixelFormat(ctx.dc, format, &pfd))
+		return false;
+
+	ctx.context = wglCreateContext(ctx.dc);
+	if(!ctx.context)
+		return false;
+
+	return (wglMakeCurrent(ctx.dc, ctx.context) != FALSE);
+}
+
+static void DestroyContext(BatchContext &ctx)
+{
+	wglMakeCurrent(NULL, NULL);
+	if(ctx.context) wglDeleteContext(ctx.context);
+	if(ctx.dc) ReleaseDC(ctx.window, ctx.dc);
+	if(ctx.window) DestroyWindow(ctx.window);
+}
+
+static GLuint CreateTexture(unsigned int width, unsigned int height)
+{
+	GLuint texture;
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	return texture;
+}
+
+static bool CreateBuffers(FFGLExtensions &ext, BatchBuffers &buf, unsigned int width, unsigned int height)
+{
+	int i;
+
+	buf.width  = width;
+	buf.height = height;
+	buf.size   = width*height*4;
+
+	ext.glGenBuffers(BATCH_RING, buf.upload);
+	ext.glGenBuffers(BATCH_RING, buf.download);
+	for(i=0; i<BATCH_RING; i++) {
+		buf.input[i]  = CreateTexture(width, height);
+		buf.output[i] = CreateTexture(width, height);
+		ext.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buf.upload[i]);
+		ext.glBufferData(GL_PIXEL_UNPACK_BUFFER, buf.size, NULL, GL_STREAM_DRAW);
+		ext.glBindBuffer(GL_PIXEL_PACK_BUFFER, buf.download[i]);
+		ext.glBufferData(GL_PIXEL_PACK_BUFFER, buf.size, NULL, GL_STREAM_READ);
+	}
+	buf.check = CreateTexture(width, height);
+	ext.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	ext.glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	ext.glGenFramebuffersEXT(1, &buf.fbo);
+	ext.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, buf.fbo);
+	ext.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, buf.output[0], 0);
+	GLenum status = ext.glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+	ext.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+
+	return (status == GL_FRAMEBUFFER_COMPLETE_EXT);
+}
+
+static void DeleteBuffers(FFGLExtensions &ext, BatchBuffers &buf)
+{
+	ext.glDeleteBuffers(BATCH_RING, buf.upload);
+	ext.glDeleteBuffers(BATCH_RING, buf.download);
+	glDeleteTextures(BATCH_RING, buf.input);
+	glDeleteTextures(BATCH_RING, buf.output);
+	glDeleteTextures(1, &buf.check);
+	ext.glDeleteFramebuffersEXT(1, &buf.fbo);
+}
+
+// Read the next frame straight into the unpack buffer of the slot
+// and start its copy into the input texture
+static bool UploadFrame(FFGLExtensions &ext, BatchBuffers &buf, int slot, FILE *file)
+{
+	unsigned char *data;
+	size_t size = 0;
+
+	ext.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buf.upload[slot]);
+	// Orphaned so that the map does not wait for the last copy
+	ext.glBufferData(GL_PIXEL_UNPACK_BUFFER, buf.size, NULL, GL_STREAM_DRAW);
+	data = (unsigned char *)ext.glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	if(data)
+		size = fread((void *)data, 1, buf.size, file);
+	ext.glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+	if(size == buf.size) {
+		glBindTexture(GL_TEXTURE_2D, buf.input[slot]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, buf.width, buf.height, GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid *)0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+	ext.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return (size == buf.size);
+}
+
+// Draw the plugin with the input texture of the slot into "output"
+static bool Process(FFGLExtensions &ext, BatchBuffers &buf, int slot, GLuint output, AutoThreshold &plugin)
+{
+	FFGLTextureStruct texture;
+	FFGLTextureStruct *inputs[1];
+	ProcessOpenGLStruct gl;
+	DWORD result;
+
+	texture.Width  = buf.width;
+	texture.Height = buf.height;
+	texture.HardwareWidth  = buf.width;
+	texture.HardwareHeight = buf.height;
+	texture.Handle = buf.input[slot];
+	inputs[0] = &texture;
+	gl.numInputTextures = 1;
+	gl.inputTextures = inputs;
+	gl.HostFBO = buf.fbo;
+
+	ext.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, buf.fbo);
+	ext.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, output, 0);
+	glViewport(0, 0, buf.width, buf.height);
+	result = plugin.ProcessOpenGL(&gl);
+
+	// The plugin's own passes may have left another FBO bound
+	ext.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, buf.fbo);
+	ext.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, output, 0);
+
+	return (result == FF_SUCCESS);
+}
+
+// Draw the plugin into the output texture of the slot
+// and start the readback into its pack buffer
+static bool DrawFrame(FFGLExtensions &ext, BatchBuffers &buf, int slot, AutoThreshold &plugin)
+{
+	bool bResult = Process(ext, buf, slot, buf.output[slot], plugin);
+
+	ext.glBindBuffer(GL_PIXEL_PACK_BUFFER, buf.download[slot]);
+	glReadPixels(0, 0, buf.width, buf.height, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid *)0);
+	ext.glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	ext.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+
+	return bResult;
+}
+
+// Write the result of a slot drawn BATCH_RING-1 frames ago
+static bool WriteFrame(FFGLExtensions &ext, BatchBuffers &buf, int slot, FILE *file)
+{
+	const unsigned char *data;
+	size_t size = 0;
+
+	ext.glBindBuffer(GL_PIXEL_PACK_BUFFER, buf.download[slot]);
+	data = (const unsigned char *)ext.glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if(data) {
+		size = fwrite((const void *)data, 1, buf.size, file);
+		ext.glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	ext.glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	return (size == buf.size);
+}
+
+// Parameter names without spaces and case
+static bool SameName(const char *name, const char *arg, size_t length)
+{
+	size_t i = 0;
+
+	for(; *name; name++) {
+		if(*name == ' ')
+			continue;
+		if(i >= length || tolower((unsigned char)*name) != tolower((unsigned char)arg[i]))
+			return false;
+		i++;
+	}
+
+	return (i == length);
+}
+
+static bool SetNamed(AutoThreshold &plugin, const char *name, size_t length, float value)
+{
+	SetParameterStruct param;
+	DWORD i;
+
+	for(i=0; i<NUM_PARAMS; i++) {
+		if(SameName(plugin.GetParamName(i), name, length)) {
+			param.ParameterNumber = i;
+			memcpy((void *)&param.NewParameterValue, (const void *)&value, sizeof(float));
+			return (plugin.SetParameter(&param) == FF_SUCCESS);
+		}
+	}
+
+	return false;
+}
+
+static bool SetParameter(AutoThreshold &plugin, const char *arg)
+{
+	const char *equals = strchr(arg, '=');
+
+	if(!equals)
+		return false;
+
+	return SetNamed(plugin, arg, (size_t)(equals - arg), (float)atof(equals + 1));
+}
+
+// Draw the frame of the slot again with Auto=0 at the threshold
+// that "plugin" used and compare the two results
+// Both are read back straight away, so this waits for the GPU
+static bool CheckFrame(FFGLExtensions &ext, BatchBuffers &buf, int slot, AutoThreshold &plugin, AutoThreshold &reference, unsigned char *pixels)
+{
+	SetNamed(reference, "Threshold", 9, plugin.GetThreshold());
+	Process(ext, buf, slot, buf.check, reference);
+	glReadPixels(0, 0, buf.width, buf.height, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid *)pixels);
+
+	ext.glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, buf.output[slot], 0);
+	glReadPixels(0, 0, buf.width, buf.height, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid *)(pixels + buf.size));
+	ext.glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+
+	return (memcmp((const void *)pixels, (const void *)(pixels + buf.size), buf.size) == 0);
+}
+
+static FILE *OpenFile(const char *path, const char *mode)
+{
+	if(strcmp(path, "-") != 0)
+		return fopen(path, mode);
+
+	if(mode[0] == 'r') {
+		_setmode(_fileno(stdin), _O_BINARY);
+		return stdin;
+	}
+	_setmode(_fileno(stdout), _O_BINARY);
+	return stdout;
+}
+
+int main(int argc, char *argv[])
+{
+	std::chrono::steady_clock::time_point start;
+	FFGLViewportStruct viewport;
+	FFGLExtensions ext;
+	BatchContext ctx;
+	BatchBuffers buf;
+	FILE *input, *output;
+	unsigned int width, height;
+	int frames, written, differ, i;
+	bool bInput, bCheck;
+	double seconds;
+	AutoThreshold *reference = NULL;
+	unsigned char *pixels = NULL;
+
+	if(argc < 5) {
+		fprintf(stderr, "AutoThresholdBatch width height input output [-check] [name=value] ...\n");
+		return 1;
+	}
+
+	width  = (unsigned int)atoi(argv[1]);
+	height = (unsigned int)atoi(argv[2]);
+	if(width < 16 || height < 16) {
+		fprintf(stderr, "Frames must be at least 16 x 16\n");
+		return 1;
+	}
+
+	if(!CreateContext(ctx)) {
+		fprintf(stderr, "Could not create a GL context\n");
+		DestroyContext(ctx);
+		return 1;
+	}
+	ext.Initialize();
+
+	input  = OpenFile(argv[3], "rb");
+	output = OpenFile(argv[4], "wb");
+	if(!input || !output) {
+		fprintf(stderr, "Could not open %s\n", input ? argv[4] : argv[3]);
+		DestroyContext(ctx);
+		return 1;
+	}
+
+	// The plugin's shaders and buffers are made in this context
+	AutoThreshold *plugin = new AutoThreshold();
+	viewport.x = 0;
+	viewport.y = 0;
+	viewport.width  = width;
+	viewport.height = height;
+	if(!CreateBuffers(ext, buf, width, height) || plugin->InitGL(&viewport) != FF_SUCCESS) {
+		fprintf(stderr, "The GL context does not support the plugin\n");
+		delete plugin;
+		DestroyContext(ctx);
+		return 1;
+	}
+
+	bCheck = false;
+	for(i=5; i<argc; i++) {
+		if(strcmp(argv[i], "-check") == 0)
+			bCheck = true;
+		else if(!SetParameter(*plugin, argv[i]))
+			fprintf(stderr, "Unknown parameter %s\n", argv[i]);
+	}
+
+	// The same settings without the auto threshold
+	if(bCheck) {
+		reference = new AutoThreshold();
+		pixels = (unsigned char *)malloc(2*buf.size);
+		if(!pixels || reference->InitGL(&viewport) != FF_SUCCESS) {
+			fprintf(stderr, "Could not start the check\n");
+			bCheck = false;
+		}
+		for(i=5; bCheck && i<argc; i++) {
+			if(strcmp(argv[i], "-check") != 0)
+				SetParameter(*reference, argv[i]);
+		}
+		SetParameter(*reference, "Auto=0");
+	}
+
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	// Frame "frames" is uploaded and drawn while the result of
+	// frame "frames - BATCH_RING + 1" is written
+	frames  = 0;
+	written = 0;
+	differ  = 0;
+	bInput  = true;
+	start = std::chrono::steady_clock::now();
+	while(bInput || written < frames) {
+		if(bInput && UploadFrame(ext, buf, frames%BATCH_RING, input)) {
+			if(!DrawFrame(ext, buf, frames%BATCH_RING, *plugin))
+				fprintf(stderr, "Frame %d was not processed\n", frames);
+			if(bCheck && !CheckFrame(ext, buf, frames%BATCH_RING, *plugin, *reference, pixels))
+				differ++;
+			frames++;
+			if(frames%BATCH_FRAMES == 0)
+				glFlush();
+		}
+		else {
+			bInput = false;
+		}
+		if(written < frames && (!bInput || frames - written >= BATCH_RING)) {
+			if(!WriteFrame(ext, buf, written%BATCH_RING, output)) {
+				fprintf(stderr, "Could not write frame %d\n", written);
+				break;
+			}
+			written++;
+		}
+	}
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fprintf(stderr, "%d frames of %dx%d in %.2f seconds, %.1f frames per second\n",
+			written, width, height, seconds, (seconds > 0.0) ? (double)written/seconds : 0.0);
+	if(bCheck)
+		fprintf(stderr, "%d of %d frames differ from Auto=0 at the same threshold\n", differ, frames);
+
+	plugin->DeInitGL();
+	delete plugin;
+	if(reference) {
+		reference->DeInitGL();
+		delete reference;
+	}
+	free(pixels);
+	DeleteBuffers(ext, buf);
+	DestroyContext(ctx);
+
+	if(input != stdin) fclose(input);
+	if(output != stdout) fclose(output);
+
+	return (written == frames && differ == 0) ? 0 : 1;
+}
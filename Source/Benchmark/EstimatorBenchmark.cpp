@@ -0,0 +1,288 @@
+//
+//		EstimatorBenchmark.cpp
+//
+//		Timing of the CPU auto threshold estimators outside a FreeFrame host
+//
+//		Each method is run with each gradient kernel the CPU supports over
+//		synthetic frames at 720p, 1080p and 4K, and over any recorded frames
+//		given on the command line. The time is reported in nanoseconds for
+//		each pixel of the frame together with the threshold found.
+//
+//		Recorded frames are raw RGBA, 4 bytes per pixel, top line first :
+//
+//			EstimatorBenchmark [width height file.rgba] ...
+//
+//		Built from this folder with the estimator sources only, for example
+//
+//			cl /O2 /EHsc EstimatorBenchmark.cpp ..\ThresholdStats.cpp ..\WorkerPool.cpp
+//			g++ -O2 -std=c++11 -pthread EstimatorBenchmark.cpp ../ThresholdStats.cpp ../WorkerPool.cpp
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include "../ThresholdStats.h"
+
+// Each measurement runs for at least this long and this many times
+#define MIN_SECONDS 0.25
+#define MIN_RUNS    5
+
+static const char *s_kernelNames[] = { "Scalar", "SSE2", "AVX2" };
+
+struct Frame {
+	std::string name;
+	int width;
+	int height;
+	std::vector<unsigned char> rgba;
+};
+
+// Repeatable pseudo random numbers
+static unsigned int Random(unsigned int &seed)
+{
+	seed = seed*1664525 + 1013904223;
+	return seed >> 8;
+}
+
+static unsigned char Clamp(int v)
+{
+	return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+//
+// Synthetic frames
+//
+// "ramp"   horizontal ramp with noise, no clear threshold
+// "scene"  dark background with bright shapes, two peaks in the histogram
+// "noise"  uniform noise, the worst case for the gradient
+//
+static void MakeFrame(Frame &frame, const char *name, int width, int height)
+{
+	unsigned int seed = 12345;
+	unsigned char *p;
+	int x, y, l, n, dx, dy;
+
+	frame.name   = name;
+	frame.width  = width;
+	frame.height = height;
+	frame.rgba.resize((size_t)width*height*4);
+
+	for(y=0; y<height; y++) {
+		p = &frame.rgba[(size_t)y*width*4];
+		for(x=0; x<width; x++) {
+			n = (int)(Random(seed)%32) - 16;
+			if(frame.name == "ramp") {
+				l = x*255/width + n;
+			}
+			else if(frame.name == "scene") {
+				// circles on a grid
+				dx = (x%(width/8)) - width/16;
+				dy = (y%(height/4)) - height/8;
+				l = (dx*dx + dy*dy < (height/12)*(height/12)) ? 200 + n : 40 + n;
+			}
+			else {
+				l = (int)(Random(seed)%256);
+			}
+			p[0] = Clamp(l + (int)(Random(seed)%16) - 8);
+			p[1] = Clamp(l);
+			p[2] = Clamp(l - (int)(Random(seed)%16) + 8);
+			p[3] = 255;
+			p += 4;
+		}
+	}
+}
+
+static bool LoadFrame(Frame &frame, const char *path, int width, int height)
+{
+	FILE *file;
+	size_t size;
+
+	if(width < 16 || height < 16)
+		return false;
+
+	file = fopen(path, "rb");
+	if(!file)
+		return false;
+
+	size = (size_t)width*height*4;
+	frame.name   = path;
+	frame.width  = width;
+	frame.height = height;
+	frame.rgba.resize(size);
+	size = fread((void *)&frame.rgba[0], 1, size, file);
+	fclose(file);
+
+	return (size == frame.rgba.size());
+}
+
+// Seconds per run of a method on a view
+static double TimeMethod(ThresholdStats &estimator, const ImageView &view, int method, float &threshold)
+{
+	std::chrono::steady_clock::time_point start;
+	FrameStats stats;
+	double seconds;
+	int runs;
+
+	// Once so that the pool threads are awake
+	threshold = estimator.estimate(view, 4, method, stats);
+
+	runs  = 0;
+	start = std::chrono::steady_clock::now();
+	do {
+		threshold = estimator.estimate(view, 4, method, stats);
+		runs++;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while(runs < MIN_RUNS || seconds < MIN_SECONDS);
+
+	return seconds/runs;
+}
+
+// Seconds per call of the histogram methods alone
+static double TimeHistogram(int method, const FrameStats &stats, float &threshold)
+{
+	std::chrono::steady_clock::time_point start;
+	double seconds;
+	int runs;
+
+	runs  = 0;
+	start = std::chrono::steady_clock::now();
+	do {
+		threshold = ThresholdStats::s_methods[method].estimate(stats);
+		runs++;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while(runs < MIN_RUNS*100 || seconds < MIN_SECONDS/10);
+
+	return seconds/runs;
+}
+
+// Seconds per call of the multi level Otsu alone
+static double TimeLevels(int levels, const FrameStats &stats, int thresholds[MAX_LEVELS-1])
+{
+	std::chrono::steady_clock::time_point start;
+	double seconds;
+	int runs;
+
+	runs  = 0;
+	start = std::chrono::steady_clock::now();
+	do {
+		ThresholdStats::otsuLevels(stats.histogram, levels, thresholds);
+		runs++;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while(runs < MIN_RUNS*100 || seconds < MIN_SECONDS/10);
+
+	return seconds/runs;
+}
+
+static void Benchmark(ThresholdStats &estimator, const Frame &frame)
+{
+	std::vector<unsigned char> luma;
+	ImageView view, lumaView;
+	FrameStats stats;
+	double seconds, pixels;
+	float threshold;
+	char size[32], name[16];
+	int thresholds[MAX_LEVELS-1];
+	int level, method, levels, i;
+
+	view.data   = &frame.rgba[0];
+	view.width  = frame.width;
+	view.height = frame.height;
+	view.pitch  = frame.width*4;
+	view.bytes  = 4;
+	view.mask   = 0;
+
+	// The luminance readback of the same frame
+	luma.resize((size_t)frame.width*frame.height);
+	for(i=0; i<frame.width*frame.height; i++)
+		luma[i] = (unsigned char)ThresholdStats::Luma(&frame.rgba[(size_t)i*4]);
+	lumaView.data   = &luma[0];
+	lumaView.width  = frame.width;
+	lumaView.height = frame.height;
+	lumaView.pitch  = frame.width;
+	lumaView.bytes  = 1;
+	lumaView.mask   = 0;
+
+	pixels = (double)frame.width*frame.height;
+	sprintf(size, "%dx%d", frame.width, frame.height);
+
+	for(level=SIMD_NONE; level<=ThresholdStats::CpuSimdLevel(); level++) {
+		estimator.SetSimdLevel(level);
+		for(method=0; method<NUM_METHODS; method++) {
+			seconds = TimeMethod(estimator, view, method, threshold);
+			printf("%-12s %-10s %-8s %-10s %10.3f %10.4f\n", frame.name.c_str(), size,
+				   s_kernelNames[level], ThresholdStats::s_methods[method].name, seconds*1.0e9/pixels, threshold);
+		}
+	}
+
+	// The SIMD kernels are for RGBA only
+	for(method=0; method<NUM_METHODS; method++) {
+		seconds = TimeMethod(estimator, lumaView, method, threshold);
+		printf("%-12s %-10s %-8s %-10s %10.3f %10.4f\n", frame.name.c_str(), size,
+			   "Luma", ThresholdStats::s_methods[method].name, seconds*1.0e9/pixels, threshold);
+	}
+
+	// Threshold from the histogram without the pass over the pixels
+	estimator.frameStats(view, 4, STATS_HISTOGRAM, stats);
+	for(method=0; method<NUM_METHODS; method++) {
+		if(ThresholdStats::s_methods[method].needs != STATS_HISTOGRAM)
+			continue;
+		seconds = TimeHistogram(method, stats, threshold);
+		printf("%-12s %-10s %-8s %-10s %10.3f %10.4f  (%.0f ns/histogram)\n", frame.name.c_str(), size,
+			   "Table", ThresholdStats::s_methods[method].name, seconds*1.0e9/pixels, threshold, seconds*1.0e9);
+	}
+
+	// Posterise levels from the same histogram, the first threshold is shown
+	for(levels=3; levels<=MAX_LEVELS; levels++) {
+		seconds = TimeLevels(levels, stats, thresholds);
+		sprintf(name, "Levels %d", levels);
+		printf("%-12s %-10s %-8s %-10s %10.3f %10.4f  (%.0f ns/histogram)\n", frame.name.c_str(), size,
+			   "Table", name, seconds*1.0e9/pixels, (float)thresholds[0]/256, seconds*1.0e9);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[3][2] = { { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+	static const char *synthetic[3] = { "ramp", "scene", "noise" };
+	ThresholdStats estimator;
+	Frame frame;
+	int i, j;
+
+	printf("%-12s %-10s %-8s %-10s %10s %10s\n", "Frame", "Size", "Kernel", "Method", "ns/pixel", "Threshold");
+
+	for(i=0; i<3; i++) {
+		for(j=0; j<3; j++) {
+			MakeFrame(frame, synthetic[j], sizes[i][0], sizes[i][1]);
+			Benchmark(estimator, frame);
+		}
+	}
+
+	// Recorded frames
+	for(i=1; i+2<argc; i+=3) {
+		if(!LoadFrame(frame, argv[i+2], atoi(argv[i]), atoi(argv[i+1]))) {
+			printf("Could not read %s\n", argv[i+2]);
+			continue;
+		}
+		Benchmark(estimator, frame);
+	}
+
+	return 0;
+}
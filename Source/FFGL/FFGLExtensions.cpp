@@ -32,6 +32,7 @@ void FFGLExtensions::Initialize()
   InitMultitexture();
   InitARBShaderObjects();
   InitEXTFramebufferObject();
+  InitTimerQuery();
 }
 
 void *FFGLExtensions::GetProcAddress(char *name)
@@ -252,6 +253,34 @@ void FFGLExtensions::InitEXTFramebufferObject()
   EXT_framebuffer_object = 1;
 }
 
+void FFGLExtensions::InitTimerQuery()
+{
+  // Queries are core in OpenGL 1.5 but GL_TIME_ELAPSED needs the extension
+  const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+  if (extensions==NULL || strstr(extensions, "_timer_query")==NULL)
+  {
+    ARB_timer_query = 0;
+    return;
+  }
+
+  try
+  {
+  glGenQueries = (glGenQueriesPROC)(unsigned)GetProcAddress("glGenQueries");
+  glDeleteQueries = (glDeleteQueriesPROC)(unsigned)GetProcAddress("glDeleteQueries");
+  glBeginQuery = (glBeginQueryPROC)(unsigned)GetProcAddress("glBeginQuery");
+  glEndQuery = (glEndQueryPROC)(unsigned)GetProcAddress("glEndQuery");
+  glGetQueryObjectuiv = (glGetQueryObjectuivPROC)(unsigned)GetProcAddress("glGetQueryObjectuiv");
+  }
+  catch (...)
+  {
+    //not supported
+    ARB_timer_query = 0;
+    return;
+  }
+
+  ARB_timer_query = 1;
+}
+
 #ifdef _WIN32
 void FFGLExtensions::InitWGLEXTSwapControl()
 {
@@ -262,12 +262,42 @@ typedef void (APIENTRY *glMultiTexCoord4svPROC) (GLenum target, const GLshort *v
 #define GL_WRITE_ONLY					0x88B9
 #define GL_READ_ONLY					0x88B8
 
+// Float textures for GPU reduction (ARB_texture_float)
+#ifndef GL_RGBA32F_ARB
+#define GL_RGBA32F_ARB					0x8814
+#endif
+
+// Vertex buffers
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER					0x8892
+#endif
+#ifndef GL_STATIC_DRAW
+#define GL_STATIC_DRAW					0x88E4
+#endif
+
 typedef void   (APIENTRY *glGenBuffersPROC) (GLsizei n, const GLuint* buffers);
 typedef void   (APIENTRY *glDeleteBuffersPROC) (GLsizei n, const GLuint* buffers);
 typedef void   (APIENTRY *glBindBufferPROC) (GLenum target, const GLuint buffer);
 typedef void   (APIENTRY *glBufferDataPROC) (GLenum target,  GLsizeiptr size,  const GLvoid * data,  GLenum usage);
 typedef void * (APIENTRY *glMapBufferPROC) (GLenum target,  GLenum access);
 typedef void   (APIENTRY *glUnmapBufferPROC) (GLenum target);
+
+// GPU timer queries (ARB_timer_query or EXT_timer_query)
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED					0x88BF
+#endif
+#ifndef GL_QUERY_RESULT
+#define GL_QUERY_RESULT					0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE
+#define GL_QUERY_RESULT_AVAILABLE		0x8867
+#endif
+
+typedef void   (APIENTRY *glGenQueriesPROC) (GLsizei n, GLuint* ids);
+typedef void   (APIENTRY *glDeleteQueriesPROC) (GLsizei n, const GLuint* ids);
+typedef void   (APIENTRY *glBeginQueryPROC) (GLenum target, GLuint id);
+typedef void   (APIENTRY *glEndQueryPROC) (GLenum target);
+typedef void   (APIENTRY *glGetQueryObjectuivPROC) (GLuint id, GLenum pname, GLuint* params);
 // ---------------------------------------------------------------------
 
 typedef void   (APIENTRY *glBindFramebufferEXTPROC) (GLenum target, GLuint framebuffer);
@@ -515,6 +545,14 @@ public:
   glBufferDataPROC glBufferData;
   glMapBufferPROC glMapBuffer;
   glUnmapBufferPROC glUnmapBuffer;
+
+  // GPU timer queries
+  int ARB_timer_query;
+  glGenQueriesPROC glGenQueries;
+  glDeleteQueriesPROC glDeleteQueries;
+  glBeginQueryPROC glBeginQuery;
+  glEndQueryPROC glEndQuery;
+  glGetQueryObjectuivPROC glGetQueryObjectuiv;
   
   
   glBindFramebufferEXTPROC glBindFramebufferEXT;
@@ -546,6 +584,7 @@ private:
   void InitMultitexture();
   void InitARBShaderObjects();
   void InitEXTFramebufferObject();
+  void InitTimerQuery();
 
 #ifdef _WIN32  
   void InitWGLEXTSwapControl();
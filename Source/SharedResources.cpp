@@ -0,0 +1,253 @@
+//
+//		SharedResources.cpp
+//
+//		Resources shared by all plugin instances in the process
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#include <FFGL.h>
+#include <chrono>
+#include "SharedResources.h"
+
+std::vector<SharedShaders *> SharedShaders::s_shaders;
+std::mutex SharedShaders::s_mutex;
+
+EstimateCache::Entry EstimateCache::s_entries[MAX_ESTIMATES];
+std::mutex EstimateCache::s_mutex;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Shaders
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+SharedShaders::SharedShaders(HGLRC glContext)
+: context(glContext),
+  refs(0),
+  bInitialized(false),
+  resolveCountLocation(-1),
+  resolveDampingLocation(-1),
+  tileGridLocation(-1),
+  tileDampingLocation(-1),
+  satOffsetLocation(-1),
+  satSizePassLocation(-1),
+  satBiasLocation(-1)
+{
+	int i;
+
+	for(i=0; i<NUM_SHADERS; i++) {
+		thresholdLocation[i]  = -1;
+		smoothnessLocation[i] = -1;
+		color1Location[i] = -1;
+		color2Location[i] = -1;
+		texScaleLocation[i] = -1;
+		satSizeLocation[i] = -1;
+		radiusLocation[i] = -1;
+		levelsLocation[i] = -1;
+		levelScaleLocation[i] = -1;
+		uniformUser[i] = NULL;
+	}
+
+	for(i=0; i<NUM_TARGETS; i++) {
+		bTargetShaders[i] = false;
+		reduceTexelLocation[i] = -1;
+	}
+
+	for(i=0; i<NUM_MASK_SHADERS; i++) {
+		maskScaleLocation[i] = -1;
+		bMaskShaders[i] = false;
+	}
+}
+
+SharedShaders *SharedShaders::Acquire()
+{
+	HGLRC glContext = wglGetCurrentContext();
+	SharedShaders *shaders = NULL;
+	size_t i;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	for(i=0; i<s_shaders.size(); i++) {
+		if(s_shaders[i]->context == glContext) {
+			shaders = s_shaders[i];
+			break;
+		}
+	}
+
+	if(!shaders) {
+		shaders = new SharedShaders(glContext);
+		s_shaders.push_back(shaders);
+	}
+
+	shaders->refs++;
+
+	return shaders;
+}
+
+void SharedShaders::Release(SharedShaders *shaders, const void *instance)
+{
+	size_t i;
+
+	if(!shaders)
+		return;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	// A later instance at the same address must load its uniforms
+	for(i=0; i<NUM_SHADERS; i++) {
+		if(shaders->uniformUser[i] == instance)
+			shaders->uniformUser[i] = NULL;
+	}
+
+	if(--shaders->refs > 0)
+		return;
+
+	for(i=0; i<NUM_SHADERS; i++)
+		shaders->shader[i].FreeGLResources();
+	for(i=0; i<NUM_TARGETS; i++) {
+		shaders->copyShader[i].FreeGLResources();
+		shaders->lumaShader[i].FreeGLResources();
+		shaders->reduceShader[i].FreeGLResources();
+	}
+	for(i=0; i<NUM_MASK_SHADERS; i++)
+		shaders->maskShader[i].FreeGLResources();
+	shaders->resolveShader.FreeGLResources();
+	shaders->tileShader.FreeGLResources();
+	shaders->satShader.FreeGLResources();
+
+	for(i=0; i<s_shaders.size(); i++) {
+		if(s_shaders[i] == shaders) {
+			s_shaders.erase(s_shaders.begin() + i);
+			break;
+		}
+	}
+
+	delete shaders;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Estimates
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool EstimateCache::Claim(const EstimateKey &key, const void *instance, unsigned int &frame)
+{
+	double now = Now();
+	Entry *e;
+	int i;
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	e = Find(key);
+	if(!e) {
+		// A free entry or one that is no longer claimed
+		for(i=0; i<MAX_ESTIMATES; i++) {
+			if(!s_entries[i].owner || now - s_entries[i].claimed > ESTIMATE_TIMEOUT) {
+				e = &s_entries[i];
+				break;
+			}
+		}
+		// No room, so the instance works alone
+		if(!e) {
+			frame = 0;
+			return true;
+		}
+		e->key       = key;
+		e->frame     = 0;
+		e->stamp     = 0;
+		e->count     = 0;
+		e->threshold = 0.0f;
+		e->bScene    = false;
+		e->owner     = NULL;
+	}
+
+	if(e->owner != instance && e->owner && now - e->claimed <= ESTIMATE_TIMEOUT) {
+		frame = e->frame;
+		return false;
+	}
+
+	e->owner   = instance;
+	e->claimed = now;
+	frame = ++e->frame;
+
+	return true;
+}
+
+void EstimateCache::Publish(const EstimateKey &key, const void *instance, unsigned int frame, float threshold, bool bScene)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	Entry *e = Find(key);
+
+	if(!e || e->owner != instance)
+		return;
+
+	e->stamp     = frame;
+	e->threshold = threshold;
+	e->bScene    = bScene;
+	e->count++;
+}
+
+bool EstimateCache::Read(const EstimateKey &key, unsigned int frame, unsigned int &count, float &threshold, bool &bScene)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	Entry *e = Find(key);
+
+	if(!e || e->count == count)
+		return false;
+
+	// Made from a frame before the reader's, beyond the cadence of the key
+	count = e->count;
+	if((int)(frame - e->stamp) > e->key.interval + ESTIMATE_FRAMES)
+		return false;
+
+	threshold = e->threshold;
+	bScene    = e->bScene;
+
+	return true;
+}
+
+void EstimateCache::Remove(const void *instance)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	for(int i=0; i<MAX_ESTIMATES; i++) {
+		if(s_entries[i].owner == instance)
+			s_entries[i].owner = NULL;
+	}
+}
+
+// Entry for the key, called with the mutex locked
+EstimateCache::Entry *EstimateCache::Find(const EstimateKey &key)
+{
+	for(int i=0; i<MAX_ESTIMATES; i++) {
+		const EstimateKey &k = s_entries[i].key;
+		if(s_entries[i].owner
+		&& k.context == key.context && k.texture == key.texture
+		&& k.width == key.width && k.height == key.height
+		&& k.method == key.method && k.decimation == key.decimation
+		&& k.stride == key.stride && k.interval == key.interval
+		&& k.incremental == key.incremental
+		&& k.luma == key.luma && k.mask == key.mask
+		&& memcmp((const void *)k.roi, (const void *)key.roi, sizeof(k.roi)) == 0)
+			return &s_entries[i];
+	}
+	return NULL;
+}
+
+double EstimateCache::Now()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,211 @@
+//
+//		SharedResources.h
+//
+//		Resources shared by all plugin instances in the process
+//
+//		SharedShaders holds the extensions and compiled shader programs
+//		of one GL context. EstimateCache passes the auto threshold made by
+//		one instance to the others that have the same input texture, so
+//		that only one of them reads back and estimates each frame.
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#ifndef SharedResources_H
+#define SharedResources_H
+
+#include <FFGLShader.h>
+#include <mutex>
+#include <vector>
+
+// Input texture targets
+// Shaders that sample the input are compiled for each
+#define TARGET_2D   0
+#define TARGET_RECT 1
+#define NUM_TARGETS 2
+
+// Shader programs for each mode, again for each source
+// of the threshold and all of them for each input target
+#define SHADER_BW      0
+#define SHADER_TWOTONE 1
+#define SHADER_CHROMA  2
+#define NUM_MODES      3
+
+// Threshold from the Threshold uniform, from the 1x1 texture
+// made by the GPU, from the tile grid of the adaptive mode or
+// from the summed area table of the local mode
+#define AUTO_UNIFORM   0
+#define AUTO_GPU       1
+#define AUTO_ADAPTIVE  2
+#define AUTO_LOCAL     3
+#define NUM_AUTO       4
+
+#define NUM_SHADERS    (NUM_MODES*NUM_AUTO*NUM_TARGETS)
+
+// Mask readback shaders for each input and mask target
+#define NUM_MASK_SHADERS (NUM_TARGETS*NUM_TARGETS)
+
+// Estimates not updated by the owner for this long can be taken over
+#define ESTIMATE_TIMEOUT 250 // msec
+
+// Instances with different inputs or settings that are sharing
+#define MAX_ESTIMATES 16
+
+// Frames that an estimate may be older than the reader's frame
+// beyond the interval, for the readback ring of the owner and its worker
+#define ESTIMATE_FRAMES 4
+
+//
+// Shader programs of one GL context
+//
+// Programs are compiled by the first instance to need them. Uniforms
+// stay with a program, so an instance loads all of them again if
+// another one has used the program since.
+//
+struct SharedShaders {
+
+	HGLRC context;
+	int refs;
+	bool bInitialized; // extensions and 2D shaders ready
+	FFGLExtensions extensions;
+
+	// Shader and uniform locations for each mode
+	FFGLShader shader[NUM_SHADERS];
+	GLint thresholdLocation[NUM_SHADERS];
+	GLint smoothnessLocation[NUM_SHADERS];
+	GLint color1Location[NUM_SHADERS];
+	GLint color2Location[NUM_SHADERS];
+	GLint texScaleLocation[NUM_SHADERS];
+	GLint satSizeLocation[NUM_SHADERS];
+	GLint radiusLocation[NUM_SHADERS];
+	GLint levelsLocation[NUM_SHADERS];
+	GLint levelScaleLocation[NUM_SHADERS];
+	const void *uniformUser[NUM_SHADERS]; // instance whose uniforms are loaded
+	bool bTargetShaders[NUM_TARGETS]; // shaders compiled for the target
+
+	// Decimated and luminance readback
+	FFGLShader copyShader[NUM_TARGETS];
+	FFGLShader lumaShader[NUM_TARGETS];
+
+	// Readback with the mask in alpha
+	FFGLShader maskShader[NUM_MASK_SHADERS];
+	GLint maskScaleLocation[NUM_MASK_SHADERS];
+	bool bMaskShaders[NUM_MASK_SHADERS];
+
+	// GPU reduction and threshold
+	FFGLShader reduceShader[NUM_TARGETS];
+	GLint reduceTexelLocation[NUM_TARGETS];
+	FFGLShader resolveShader;
+	GLint resolveCountLocation;
+	GLint resolveDampingLocation;
+
+	// Tile thresholds of the adaptive mode
+	FFGLShader tileShader;
+	GLint tileGridLocation;
+	GLint tileDampingLocation;
+
+	// Prefix sums of the local mode
+	FFGLShader satShader;
+	GLint satOffsetLocation;
+	GLint satSizePassLocation;
+	GLint satBiasLocation;
+
+	SharedShaders(HGLRC glContext);
+
+	// The shaders of the current context, created if needed
+	static SharedShaders *Acquire();
+
+	// Deleted with the GL resources when the last instance releases them
+	// The context must be current
+	static void Release(SharedShaders *shaders, const void *instance);
+
+private:
+
+	static std::vector<SharedShaders *> s_shaders;
+	static std::mutex s_mutex;
+
+};
+
+// Input and settings that give the same estimate
+struct EstimateKey {
+	HGLRC context;
+	GLuint texture;
+	unsigned int width;
+	unsigned int height;
+	int method;
+	int decimation; // after the budget
+	int stride; // budget multiplier of the sampling stride
+	int interval; // frames between estimates after the budget
+	int incremental;
+	int luma;
+	unsigned int roi[4]; // x, y, width and height in pixels
+	GLuint mask;
+};
+
+//
+// Auto threshold estimates shared between instances
+//
+// The first instance to claim a key is the owner and makes the
+// estimates. The others read them instead of their own readback.
+// An owner that stops claiming, because it has been removed or its
+// settings have changed, is replaced by the next instance to claim.
+// Frames of a key are counted by the owner's claims. Each estimate is
+// stamped with the frame it was read back in and a reader only takes
+// estimates made within the interval and the readback lag of its own.
+//
+class EstimateCache
+{
+public:
+
+	// Returns true if the instance owns the key and makes the estimates
+	// Also returns true if there is no room to share
+	// "frame" is the frame of the key, counted by the owner's claims
+	static bool Claim(const EstimateKey &key, const void *instance, unsigned int &frame);
+
+	// A new estimate by the owner of a frame read back in "frame"
+	static void Publish(const EstimateKey &key, const void *instance, unsigned int frame, float threshold, bool bScene);
+
+	// Returns true if the owner has published since "count" and updates it
+	// Estimates too old for the reader's "frame" are passed over
+	static bool Read(const EstimateKey &key, unsigned int frame, unsigned int &count, float &threshold, bool &bScene);
+
+	// The instance no longer owns any key
+	static void Remove(const void *instance);
+
+private:
+
+	struct Entry {
+		EstimateKey key;
+		const void *owner;
+		double claimed; // msec of the last claim
+		unsigned int frame; // claims by the owner, one each frame
+		unsigned int stamp; // frame of the last estimate
+		unsigned int count; // estimates published
+		float threshold;
+		bool bScene; // made after a change of scene
+	};
+
+	static Entry *Find(const EstimateKey &key);
+	static double Now();
+
+	static Entry s_entries[MAX_ESTIMATES];
+	static std::mutex s_mutex;
+
+};
+
+#endif
@@ -0,0 +1,1197 @@
+//
+//		ThresholdStats.cpp
+//
+//		Statistics of readback frames and the auto threshold methods
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+
+// SSE2 and AVX2 estimator kernels for x86 and x64
+// The AVX2 kernel is only used if the CPU and OS support it
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define AUTOTHRESHOLD_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_FUNCTION
+#else
+#include <cpuid.h>
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+#include "ThresholdStats.h"
+
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Estimator kernels
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Instruction set supported by both the CPU and the OS
+int ThresholdStats::CpuSimdLevel()
+{
+	int level = SIMD_NONE;
+
+#ifdef AUTOTHRESHOLD_SIMD
+	unsigned int info[4] = { 0, 0, 0, 0 }; // EAX, EBX, ECX, EDX
+	unsigned int maxLeaf;
+	unsigned long long xcr0 = 0;
+
+#ifdef _MSC_VER
+	__cpuid((int *)info, 0);
+	maxLeaf = info[0];
+	__cpuid((int *)info, 1);
+#else
+	maxLeaf = __get_cpuid_max(0, 0);
+	__cpuid(1, info[0], info[1], info[2], info[3]);
+#endif
+
+	if(info[3] & (1 << 26)) // SSE2
+		level = SIMD_SSE2;
+
+	// AVX2 also needs the OS to save the YMM registers (OSXSAVE and XCR0)
+	if(maxLeaf >= 7 && (info[2] & (1 << 27))) {
+#ifdef _MSC_VER
+		xcr0 = _xgetbv(0);
+		__cpuidex((int *)info, 7, 0);
+#else
+		unsigned int lo, hi;
+		__asm__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		xcr0 = ((unsigned long long)hi << 32) | lo;
+		__cpuid_count(7, 0, info[0], info[1], info[2], info[3]);
+#endif
+		if((xcr0 & 6) == 6 && (info[1] & (1 << 5)))
+			level = SIMD_AVX2;
+	}
+#endif
+
+	return level;
+}
+
+//
+// Luminance in 16 bit fixed point with the weights of grayScaleWeights
+// in the shader. The weights add up to 65536 so that white is 255.
+//
+struct LumaTable {
+	unsigned int r[256], g[256], b[256];
+	LumaTable() {
+		for(int i=0; i<256; i++) {
+			r[i] = i*19661; // 0.30
+			g[i] = i*38666; // 0.59
+			b[i] = i*7209;  // 0.11
+		}
+	}
+};
+static const LumaTable s_luma;
+#define LUMA(p) ((s_luma.r[(p)[0]] + s_luma.g[(p)[1]] + s_luma.b[(p)[2]]) >> 16)
+
+//
+// Gradient sums for the sampled columns of one line
+//
+// linePtr is the start of the line and pitch is the distance
+// to the lines above and below. Columns from "first" up to
+// but not including "last" are sampled every "stride" pixels.
+//
+static void gradientLineScalar(const unsigned char *linePtr, int pitch, int first, int last, int stride,
+							   long long &sum_exy, long long &sum_exy_fxy)
+{
+	int j;
+	int left, right, top, bot, mid;
+	int ex, ey, exy;
+	const unsigned char *lp;
+
+	for(j=first; j<last; j+=stride) { // every stride columns for speed
+
+		lp = linePtr + j*4; // start of the pixel
+
+		// neighbours
+		// Move across the line 4 pixels at a time
+		// Pointer starts at R (*)
+		//
+		// [R G B A][R G B A][R G B A]
+		// [R G B A][* G B A][R G B A]
+		// [R G B A][R G B A][R G B A]
+		//
+		left  = (int)*(lp-4) + (int)*(lp-3) + (int)*(lp-2);				// Left
+		mid   = (int)*(lp  ) + (int)*(lp+1) + (int)*(lp+2);				// Centre
+		right = (int)*(lp+4) + (int)*(lp+5) + (int)*(lp+6);				// Right
+		top   = (int)*(lp-pitch) + (int)*(lp-pitch+1) + (int)*(lp-pitch+2);	// Top
+		bot   = (int)*(lp+pitch) + (int)*(lp+pitch+1) + (int)*(lp+pitch+2);	// Bot
+
+		// calculate variance of neighbourhood
+		ex           = abs(left - right);
+		ey           = abs(top - bot);
+		exy          = MAX(ex, ey);
+		sum_exy     += exy;
+		sum_exy_fxy += exy*mid;
+
+	} // end of all pixels in this line
+}
+
+//
+// Gradient sums for the sampled columns of one line of luminance
+//
+// As for gradientLineScalar with one byte for each pixel.
+// The levels are 0-255 rather than the RGB sums 0-765.
+//
+static void gradientLineLuma(const unsigned char *linePtr, int pitch, int first, int last, int stride,
+							 long long &sum_exy, long long &sum_exy_fxy)
+{
+	int j;
+	int ex, ey, exy;
+	const unsigned char *lp;
+
+	for(j=first; j<last; j+=stride) {
+		lp  = linePtr + j;
+		ex  = abs((int)lp[-1] - (int)lp[1]);
+		ey  = abs((int)lp[-pitch] - (int)lp[pitch]);
+		exy = MAX(ex, ey);
+		sum_exy     += exy;
+		sum_exy_fxy += exy*(int)lp[0];
+	}
+}
+
+//
+// Gradient sums for the sampled columns of one line of masked RGBA
+//
+// As for gradientLineScalar with each sample weighted by the
+// alpha of the centre pixel, so that a mask of 0 leaves it out.
+//
+static void gradientLineMasked(const unsigned char *linePtr, int pitch, int first, int last, int stride,
+							   long long &sum_exy, long long &sum_exy_fxy)
+{
+	int j;
+	int left, right, top, bot, mid;
+	int exy, weight;
+	const unsigned char *lp;
+
+	for(j=first; j<last; j+=stride) {
+		lp = linePtr + j*4;
+		weight = (int)lp[3];
+		if(weight == 0)
+			continue;
+		left  = (int)*(lp-4) + (int)*(lp-3) + (int)*(lp-2);
+		mid   = (int)*(lp  ) + (int)*(lp+1) + (int)*(lp+2);
+		right = (int)*(lp+4) + (int)*(lp+5) + (int)*(lp+6);
+		top   = (int)*(lp-pitch) + (int)*(lp-pitch+1) + (int)*(lp-pitch+2);
+		bot   = (int)*(lp+pitch) + (int)*(lp+pitch+1) + (int)*(lp+pitch+2);
+		exy   = MAX(abs(left - right), abs(top - bot))*weight;
+		sum_exy     += exy;
+		sum_exy_fxy += (long long)exy*mid;
+	}
+}
+
+#ifdef AUTOTHRESHOLD_SIMD
+
+//
+// SSE2 kernel for a stride of 4
+//
+// 16 bytes loaded one pixel before a sample hold [left, mid, right, next].
+// Four such loads cover four samples. The R+G+B sums of each load are
+// made with multiply-add against ones and transposed so that each
+// register holds the left, mid or right of the four samples.
+// All values are below 32768 so the products and maximum can use
+// 16 bit operations on the low half of each 32 bit lane.
+//
+
+// R+G+B of four RGBA pixels as 32 bit integers
+static inline __m128i PixelSums(__m128i v, __m128i rgbMask, __m128i ones)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo, hi;
+	v  = _mm_and_si128(v, rgbMask);
+	lo = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), ones); // R+G, B of pixels 0 and 1
+	hi = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), ones); // R+G, B of pixels 2 and 3
+	return _mm_madd_epi16(_mm_packs_epi32(lo, hi), ones);
+}
+
+static inline __m128i AbsDiff(__m128i a, __m128i b)
+{
+	__m128i d = _mm_sub_epi32(a, b);
+	__m128i m = _mm_srai_epi32(d, 31);
+	return _mm_sub_epi32(_mm_xor_si128(d, m), m);
+}
+
+static inline int HorizontalSum(__m128i v)
+{
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+static void gradientLineSSE2(const unsigned char *linePtr, int pitch, int first, int last,
+							 long long &sum_exy, long long &sum_exy_fxy)
+{
+	const __m128i rgbMask = _mm_set1_epi32(0x00FFFFFF);
+	const __m128i ones    = _mm_set1_epi16(1);
+	__m128i acc_exy = _mm_setzero_si128();
+	__m128i acc_fxy = _mm_setzero_si128();
+	__m128i s0, s1, s2, s3, t0, t1, t2, t3;
+	__m128i left, mid, right, top, bot, exy;
+	const unsigned char *lp;
+	int j = first;
+
+	// Four samples j, j+4, j+8, j+12 per step
+	for(; j+12 < last; j+=16) {
+
+		lp = linePtr + (j-1)*4;
+
+		// Centre line
+		s0 = PixelSums(_mm_loadu_si128((const __m128i *)(lp     )), rgbMask, ones);
+		s1 = PixelSums(_mm_loadu_si128((const __m128i *)(lp + 16)), rgbMask, ones);
+		s2 = PixelSums(_mm_loadu_si128((const __m128i *)(lp + 32)), rgbMask, ones);
+		s3 = PixelSums(_mm_loadu_si128((const __m128i *)(lp + 48)), rgbMask, ones);
+		t0 = _mm_unpacklo_epi32(s0, s1);
+		t1 = _mm_unpacklo_epi32(s2, s3);
+		t2 = _mm_unpackhi_epi32(s0, s1);
+		t3 = _mm_unpackhi_epi32(s2, s3);
+		left  = _mm_unpacklo_epi64(t0, t1);
+		mid   = _mm_unpackhi_epi64(t0, t1);
+		right = _mm_unpacklo_epi64(t2, t3);
+
+		// Line above
+		s0 = PixelSums(_mm_loadu_si128((const __m128i *)(lp - pitch     )), rgbMask, ones);
+		s1 = PixelSums(_mm_loadu_si128((const __m128i *)(lp - pitch + 16)), rgbMask, ones);
+		s2 = PixelSums(_mm_loadu_si128((const __m128i *)(lp - pitch + 32)), rgbMask, ones);
+		s3 = PixelSums(_mm_loadu_si128((const __m128i *)(lp - pitch + 48)), rgbMask, ones);
+		top = _mm_unpackhi_epi64(_mm_unpacklo_epi32(s0, s1), _mm_unpacklo_epi32(s2, s3));
+
+		// Line below
+		s0 = PixelSums(_mm_loadu_si128((const __m128i *)(lp + pitch     )), rgbMask, ones);
+		s1 = PixelSums(_mm_loadu_si128((const __m128i *)(lp + pitch + 16)), rgbMask, ones);
+		s2 = PixelSums(_mm_loadu_si128((const __m128i *)(lp + pitch + 32)), rgbMask, ones);
+		s3 = PixelSums(_mm_loadu_si128((const __m128i *)(lp + pitch + 48)), rgbMask, ones);
+		bot = _mm_unpackhi_epi64(_mm_unpacklo_epi32(s0, s1), _mm_unpacklo_epi32(s2, s3));
+
+		// exy = MAX(abs(left-right), abs(top-bot))
+		exy = _mm_max_epi16(AbsDiff(left, right), AbsDiff(top, bot));
+		acc_exy = _mm_add_epi32(acc_exy, exy);
+		acc_fxy = _mm_add_epi32(acc_fxy, _mm_madd_epi16(exy, mid));
+	}
+
+	// The 32 bit lane totals of one line cannot overflow
+	sum_exy     += HorizontalSum(acc_exy);
+	sum_exy_fxy += (unsigned int)HorizontalSum(acc_fxy);
+
+	// Remaining samples
+	gradientLineScalar(linePtr, pitch, j, last, 4, sum_exy, sum_exy_fxy);
+}
+
+//
+// AVX2 kernel for a stride of 4
+//
+// As for SSE2 but each 32 byte load holds the neighbourhoods of two
+// samples, one in each 128 bit lane, so eight samples are done per step.
+//
+
+AVX2_FUNCTION
+static inline __m256i PixelSums256(__m256i v, __m256i rgbMask, __m256i ones)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo, hi;
+	v  = _mm256_and_si256(v, rgbMask);
+	lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(v, zero), ones);
+	hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(v, zero), ones);
+	return _mm256_madd_epi16(_mm256_packs_epi32(lo, hi), ones);
+}
+
+AVX2_FUNCTION
+static inline __m256i MidSums256(const unsigned char *lp, __m256i rgbMask, __m256i ones)
+{
+	__m256i s0 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp     )), rgbMask, ones);
+	__m256i s1 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp + 32)), rgbMask, ones);
+	__m256i s2 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp + 64)), rgbMask, ones);
+	__m256i s3 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp + 96)), rgbMask, ones);
+	return _mm256_unpackhi_epi64(_mm256_unpacklo_epi32(s0, s1), _mm256_unpacklo_epi32(s2, s3));
+}
+
+AVX2_FUNCTION
+static void gradientLineAVX2(const unsigned char *linePtr, int pitch, int first, int last,
+							 long long &sum_exy, long long &sum_exy_fxy)
+{
+	const __m256i rgbMask = _mm256_set1_epi32(0x00FFFFFF);
+	const __m256i ones    = _mm256_set1_epi16(1);
+	__m256i acc_exy = _mm256_setzero_si256();
+	__m256i acc_fxy = _mm256_setzero_si256();
+	__m256i s0, s1, s2, s3, t0, t1, t2, t3;
+	__m256i left, mid, right, top, bot, ex, ey, exy;
+	__m128i sum;
+	const unsigned char *lp;
+	int j = first;
+
+	// Eight samples j to j+28 per step
+	for(; j+28 < last; j+=32) {
+
+		lp = linePtr + (j-1)*4;
+
+		s0 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp     )), rgbMask, ones);
+		s1 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp + 32)), rgbMask, ones);
+		s2 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp + 64)), rgbMask, ones);
+		s3 = PixelSums256(_mm256_loadu_si256((const __m256i *)(lp + 96)), rgbMask, ones);
+		t0 = _mm256_unpacklo_epi32(s0, s1);
+		t1 = _mm256_unpacklo_epi32(s2, s3);
+		t2 = _mm256_unpackhi_epi32(s0, s1);
+		t3 = _mm256_unpackhi_epi32(s2, s3);
+		left  = _mm256_unpacklo_epi64(t0, t1);
+		mid   = _mm256_unpackhi_epi64(t0, t1);
+		right = _mm256_unpacklo_epi64(t2, t3);
+
+		top = MidSums256(lp - pitch, rgbMask, ones);
+		bot = MidSums256(lp + pitch, rgbMask, ones);
+
+		ex  = _mm256_abs_epi32(_mm256_sub_epi32(left, right));
+		ey  = _mm256_abs_epi32(_mm256_sub_epi32(top, bot));
+		exy = _mm256_max_epi32(ex, ey);
+		acc_exy = _mm256_add_epi32(acc_exy, exy);
+		acc_fxy = _mm256_add_epi32(acc_fxy, _mm256_madd_epi16(exy, mid));
+	}
+
+	sum = _mm_add_epi32(_mm256_castsi256_si128(acc_exy), _mm256_extracti128_si256(acc_exy, 1));
+	sum_exy += HorizontalSum(sum);
+	sum = _mm_add_epi32(_mm256_castsi256_si128(acc_fxy), _mm256_extracti128_si256(acc_fxy, 1));
+	sum_exy_fxy += (unsigned int)HorizontalSum(sum);
+
+	// Clear the upper halves of the ymm registers so that the SSE and
+	// scalar code after this does not pay for the AVX to SSE transition
+	_mm256_zeroupper();
+
+	// Remaining samples
+	gradientLineScalar(linePtr, pitch, j, last, 4, sum_exy, sum_exy_fxy);
+}
+
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Constructor and destructor
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ThresholdStats::ThresholdStats()
+: m_SimdLevel(SIMD_NONE),
+  m_pool(NULL),
+  m_bandView(NULL),
+  m_bandStride(4),
+  m_bandFlags(0),
+  m_bandLines(0),
+  m_bIncremental(false),
+  m_tileWidth(0),
+  m_tileHeight(0),
+  m_tileStride(0),
+  m_tileFlags(0),
+  m_tileBytes(0),
+  m_tileMask(0),
+  m_tileFrames(0)
+{
+	// Fastest instruction set for the estimators
+	m_SimdLevel = CpuSimdLevel();
+
+	// Estimator threads
+	m_pool = WorkerPool::Acquire();
+}
+
+ThresholdStats::~ThresholdStats()
+{
+	if(m_pool) WorkerPool::Release();
+}
+
+// Levels above those supported by the CPU are not used
+void ThresholdStats::SetSimdLevel(int level)
+{
+	m_SimdLevel = MAX(SIMD_NONE, MIN(level, CpuSimdLevel()));
+}
+
+void ThresholdStats::SetIncremental(bool bIncremental)
+{
+	m_bIncremental = bIncremental;
+	// Tiles are counted again when next used
+	m_tileWidth = 0;
+}
+
+unsigned int ThresholdStats::Luma(const unsigned char *p)
+{
+	return LUMA(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Statistics
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// Gradient sums for columns "first" to "last" of one line
+// using the fastest kernel available
+//
+// The SIMD kernels are for RGBA at the default stride of 4 and
+// give exactly the same sums as the scalar code. Masked frames
+// always use the scalar code.
+//
+void ThresholdStats::gradientLine(const unsigned char *linePtr, int pitch, int first, int last, int stride, int bytes, int mask, long long &sum_exy, long long &sum_exy_fxy)
+{
+	if(bytes == 1) {
+		gradientLineLuma(linePtr, pitch, first, last, stride, sum_exy, sum_exy_fxy);
+		return;
+	}
+	if(mask) {
+		gradientLineMasked(linePtr, pitch, first, last, stride, sum_exy, sum_exy_fxy);
+		return;
+	}
+#ifdef AUTOTHRESHOLD_SIMD
+	if(stride == 4) {
+		if(m_SimdLevel >= SIMD_AVX2) {
+			gradientLineAVX2(linePtr, pitch, first, last, sum_exy, sum_exy_fxy);
+			return;
+		}
+		if(m_SimdLevel >= SIMD_SSE2) {
+			gradientLineSSE2(linePtr, pitch, first, last, sum_exy, sum_exy_fxy);
+			return;
+		}
+	}
+#endif
+	gradientLineScalar(linePtr, pitch, first, last, stride, sum_exy, sum_exy_fxy);
+}
+
+//
+// Gradient and histogram for a region of the frame
+//
+// Lines "first" to "last" and columns "left" to "right".
+// Every sampled line is read once for the histogram and the gradient
+// while it is in cache. Pixels are sampled every "stride" lines and
+// columns, counted from the top left of the frame so that bands and
+// tiles give the same result as a single pass.
+//
+void ThresholdStats::regionStats(const ImageView &view, int stride, int flags, int first, int last, int left, int right, BandStats &band)
+{
+	int i, j, n;
+	int gradFirst, gradLast;
+	unsigned int *hist0, *hist1, *hist2, *hist3;
+	const unsigned char *linePtr;
+	const unsigned char *lp;
+	int step = stride*view.bytes; // bytes between sampled pixels
+
+	band.sum_exy     = 0;
+	band.sum_exy_fxy = 0;
+	band.samples     = 0;
+	if(flags & STATS_HISTOGRAM)
+		memset((void *)band.histogram, 0, sizeof(band.histogram));
+
+	hist0 = band.histogram[0];
+	hist1 = band.histogram[1];
+	hist2 = band.histogram[2];
+	hist3 = band.histogram[3];
+
+	// First sampled line and column of the region
+	i    = ((first + stride - 1)/stride)*stride;
+	left = ((left + stride - 1)/stride)*stride;
+
+	// Gradient needs the columns to each side
+	gradFirst = MAX(left, stride);
+	gradLast  = MIN(right, view.width-stride);
+
+	for(; i<last; i+=stride) {
+
+		linePtr = view.data + i*view.pitch; // start of the line
+
+		if(flags & STATS_HISTOGRAM && left < right) {
+			// Four pixels at a time into separate sub-histograms
+			lp = linePtr + left*view.bytes;
+			n  = (right - left + stride - 1)/stride;
+			band.samples += n;
+			if(view.bytes == 1) {
+				// [L] is the bin
+				for(j=0; j+4<=n; j+=4) {
+					hist0[lp[0]]++;
+					hist1[lp[step]]++;
+					hist2[lp[step*2]]++;
+					hist3[lp[step*3]]++;
+					lp += step*4;
+				}
+				for(; j<n; j++) {
+					hist0[*lp]++;
+					lp += step;
+				}
+			}
+			else if(view.mask) {
+				// [R G B A] with pixels under the mask left out
+				for(j=0; j<n; j++) {
+					if(lp[3] >= MASK_LEVEL)
+						hist0[LUMA(lp)]++;
+					else
+						band.samples--;
+					lp += step;
+				}
+			}
+			else {
+				// [R G B A]
+				for(j=0; j+4<=n; j+=4) {
+					hist0[LUMA(lp)]++;
+					hist1[LUMA(lp+step)]++;
+					hist2[LUMA(lp+step*2)]++;
+					hist3[LUMA(lp+step*3)]++;
+					lp += step*4;
+				}
+				for(; j<n; j++) {
+					hist0[LUMA(lp)]++;
+					lp += step;
+				}
+			}
+		}
+
+		// and the lines above and below
+		if((flags & STATS_GRADIENT) && i >= stride && i < view.height-stride && gradFirst < gradLast)
+			gradientLine(linePtr, view.pitch, gradFirst, gradLast, stride, view.bytes, view.mask, band.sum_exy, band.sum_exy_fxy);
+	}
+}
+
+// Worker pool job for one band
+void ThresholdStats::StatsBand(void *data, int band)
+{
+	ThresholdStats *estimator = (ThresholdStats *)data;
+	int first = band*estimator->m_bandLines;
+	int last  = MIN(first + estimator->m_bandLines, estimator->m_bandView->height);
+
+	estimator->regionStats(*estimator->m_bandView, estimator->m_bandStride, estimator->m_bandFlags,
+					    first, last, 0, estimator->m_bandView->width, estimator->m_bands[band]);
+}
+
+//
+// Gradient sums and histogram of a frame
+//
+// The frame is split into horizontal bands that are processed by the
+// worker pool. Gradient sums and histogram bins of each band are then
+// added together.
+//
+void ThresholdStats::frameStats(const ImageView &view, int stride, int flags, FrameStats &stats)
+{
+	int i, j, k, bands;
+
+	if(flags & (STATS_LEVELS | STATS_PERCENTILES))
+		flags |= STATS_HISTOGRAM;
+
+	// Only the tiles that have changed
+	if(m_bIncremental) {
+		tileStats(view, stride, flags, stats);
+		return;
+	}
+
+	// A few bands per thread to balance the load
+	bands = 1;
+	if(m_pool)
+		bands = MIN(m_pool->GetThreadCount()*4, MAX_BANDS);
+	bands = MAX(1, MIN(bands, view.height/MIN_BAND_LINES));
+
+	m_bandView   = &view;
+	m_bandStride = stride;
+	m_bandFlags  = flags;
+	m_bandLines  = (view.height + bands - 1)/bands;
+
+	if(m_pool)
+		m_pool->Run(StatsBand, (void *)this, bands);
+	else
+		StatsBand((void *)this, 0);
+
+	// Merge the bands
+	stats.width       = view.width;
+	stats.height      = view.height;
+	stats.sum_exy     = 0;
+	stats.sum_exy_fxy = 0;
+	stats.samples     = 0;
+	if(flags & STATS_HISTOGRAM)
+		memset((void *)stats.histogram, 0, 256*sizeof(unsigned int));
+
+	for(i=0; i<bands; i++) {
+		stats.sum_exy     += m_bands[i].sum_exy;
+		stats.sum_exy_fxy += m_bands[i].sum_exy_fxy;
+		if(flags & STATS_HISTOGRAM) {
+			stats.samples += m_bands[i].samples;
+			for(j=0; j<NUM_SUBHISTOGRAMS; j++) {
+				for(k=0; k<256; k++)
+					stats.histogram[k] += m_bands[i].histogram[j][k];
+			}
+		}
+	}
+
+	stats.flags = flags;
+	stats.bytes = view.bytes;
+	levelStats(flags, stats);
+}
+
+//
+// Incremental statistics
+//
+// The frame is divided into a grid of tiles that keep their own
+// gradient sums and histogram. A signature of the sampled pixels of
+// each tile is compared with the last frame and only tiles that have
+// changed are counted again. The frame totals are then updated
+// by the difference. All tiles are counted again every
+// TILE_REFRESH frames in case a change was missed by the signature.
+//
+void ThresholdStats::tileStats(const ImageView &view, int stride, int flags, FrameStats &stats)
+{
+	int i, k;
+
+	// Start again if the frame or the statistics wanted are different
+	if(view.width != m_tileWidth || view.height != m_tileHeight
+	|| stride != m_tileStride || flags != m_tileFlags || view.bytes != m_tileBytes
+	|| view.mask != m_tileMask
+	|| ++m_tileFrames >= TILE_REFRESH) {
+		memset((void *)m_tiles, 0, sizeof(m_tiles));
+		memset((void *)&m_tileTotal, 0, sizeof(FrameStats));
+		m_tileWidth  = view.width;
+		m_tileHeight = view.height;
+		m_tileStride = stride;
+		m_tileFlags  = flags;
+		m_tileBytes  = view.bytes;
+		m_tileMask   = view.mask;
+		m_tileFrames = 0;
+	}
+
+	m_bandView   = &view;
+	m_bandStride = stride;
+	m_bandFlags  = flags;
+
+	if(m_pool)
+		m_pool->Run(StatsTile, (void *)this, NUM_TILES);
+	else {
+		for(i=0; i<NUM_TILES; i++)
+			StatsTile((void *)this, i);
+	}
+
+	// Add the changes
+	for(i=0; i<NUM_TILES; i++) {
+		TileStats &tile = m_tiles[i];
+		if(!tile.changed)
+			continue;
+		m_tileTotal.sum_exy     += tile.delta_exy;
+		m_tileTotal.sum_exy_fxy += tile.delta_exy_fxy;
+		m_tileTotal.samples     += tile.delta_samples;
+		if(flags & STATS_HISTOGRAM) {
+			for(k=0; k<256; k++)
+				m_tileTotal.histogram[k] += tile.delta[k];
+		}
+	}
+
+	stats.width       = view.width;
+	stats.height      = view.height;
+	stats.sum_exy     = m_tileTotal.sum_exy;
+	stats.sum_exy_fxy = m_tileTotal.sum_exy_fxy;
+	stats.samples     = m_tileTotal.samples;
+	if(flags & STATS_HISTOGRAM)
+		memcpy((void *)stats.histogram, (const void *)m_tileTotal.histogram, 256*sizeof(unsigned int));
+
+	stats.flags = flags;
+	stats.bytes = view.bytes;
+	levelStats(flags, stats);
+}
+
+// Worker pool job for one tile
+void ThresholdStats::StatsTile(void *data, int tile)
+{
+	ThresholdStats *estimator = (ThresholdStats *)data;
+	const ImageView &view = *estimator->m_bandView;
+	int stride = estimator->m_bandStride;
+	int flags  = estimator->m_bandFlags;
+	TileStats &t = estimator->m_tiles[tile];
+	unsigned long long signature;
+	BandStats band;
+	unsigned int count;
+	int tx, ty, left, right, first, last;
+	int j, k;
+
+	// Tile edges on the sampling grid so that the tiles
+	// add up to the same samples as the whole frame
+	tx = tile%TILE_GRID;
+	ty = tile/TILE_GRID;
+	left  = ((tx*view.width/TILE_GRID)/stride)*stride;
+	right = (tx == TILE_GRID-1) ? view.width : (((tx+1)*view.width/TILE_GRID)/stride)*stride;
+	first = ((ty*view.height/TILE_GRID)/stride)*stride;
+	last  = (ty == TILE_GRID-1) ? view.height : (((ty+1)*view.height/TILE_GRID)/stride)*stride;
+
+	t.changed = false;
+	signature = TileSignature(view, stride, first, last, left, right);
+	if(t.valid && signature == t.signature)
+		return;
+
+	estimator->regionStats(view, stride, flags, first, last, left, right, band);
+
+	t.delta_exy     = band.sum_exy - t.sum_exy;
+	t.delta_exy_fxy = band.sum_exy_fxy - t.sum_exy_fxy;
+	t.delta_samples = (int)band.samples - (int)t.samples;
+	t.sum_exy       = band.sum_exy;
+	t.sum_exy_fxy   = band.sum_exy_fxy;
+	t.samples       = band.samples;
+	if(flags & STATS_HISTOGRAM) {
+		for(k=0; k<256; k++) {
+			count = band.histogram[0][k];
+			for(j=1; j<NUM_SUBHISTOGRAMS; j++)
+				count += band.histogram[j][k];
+			t.delta[k]     = (int)count - (int)t.histogram[k];
+			t.histogram[k] = count;
+		}
+	}
+	t.signature = signature;
+	t.valid     = true;
+	t.changed   = true;
+}
+
+//
+// Signature of a tile
+//
+// A running checksum of the sampled pixels. Any change to the pixels
+// in the histogram is seen, but changes to the neighbours used only
+// for the gradient are not. This is much less work than the
+// statistics because there is no table lookup or bin increment.
+//
+unsigned long long ThresholdStats::TileSignature(const ImageView &view, int stride, int first, int last, int left, int right)
+{
+	unsigned long long a = 1;
+	unsigned long long b = 0;
+	const unsigned int *lp;
+	const unsigned char *bp;
+	int i, j;
+
+	for(i=first; i<last; i+=stride) {
+		if(view.bytes == 1) {
+			bp = view.data + i*view.pitch + left;
+			for(j=left; j<right; j+=stride) {
+				a += *bp;
+				b += a;
+				bp += stride;
+			}
+		}
+		else {
+			lp = (const unsigned int *)(view.data + i*view.pitch) + left;
+			for(j=left; j<right; j+=stride) {
+				a += *lp;
+				b += a;
+				lp += stride;
+			}
+		}
+	}
+
+	return a ^ (b << 21) ^ (b >> 43);
+}
+
+//
+// Mean, minimum, maximum and percentiles from the histogram
+//
+void ThresholdStats::levelStats(int flags, FrameStats &stats)
+{
+	static const int percent[NUM_PERCENTILES] = { 5, 25, 50, 75, 95 };
+	unsigned long long total;
+	unsigned long long count;
+	unsigned int limit;
+	int i, k;
+
+	stats.mean    = 0.0f;
+	stats.minimum = 0;
+	stats.maximum = 0;
+	memset((void *)stats.percentile, 0, sizeof(stats.percentile));
+
+	if(!(flags & (STATS_LEVELS | STATS_PERCENTILES)) || stats.samples == 0)
+		return;
+
+	if(flags & STATS_LEVELS) {
+		total = 0;
+		for(k=0; k<256; k++)
+			total += (unsigned long long)k*stats.histogram[k];
+		stats.mean = (float)((double)total/stats.samples);
+		for(k=0; k<255 && stats.histogram[k] == 0; k++);
+		stats.minimum = k;
+		for(k=255; k>0 && stats.histogram[k] == 0; k--);
+		stats.maximum = k;
+	}
+
+	if(flags & STATS_PERCENTILES) {
+		// First level where the cumulative count passes each limit
+		count = 0;
+		k = 0;
+		for(i=0; i<NUM_PERCENTILES; i++) {
+			limit = (unsigned int)(((unsigned long long)stats.samples*percent[i] + 99)/100);
+			while(k < 255 && count + stats.histogram[k] < limit)
+				count += stats.histogram[k++];
+			stats.percentile[i] = k;
+		}
+	}
+}
+
+//
+// Auto threshold for a frame
+//
+// Only the statistics needed by the method are calculated.
+// Gradient and histogram are made in the same pass if both are needed.
+//
+float ThresholdStats::estimate(const ImageView &view, int stride, int method, FrameStats &stats)
+{
+	const ThresholdMethod &m = s_methods[method];
+
+	frameStats(view, stride, m.needs, stats);
+
+	return m.estimate(stats);
+}
+
+//
+// Auto threshold and the thresholds of "levels" output levels
+//
+// The histogram for the multi level Otsu is made in the same pass
+// as the statistics of the method. The level thresholds are 0-1 in
+// increasing order, evenly spaced if the histogram is empty.
+//
+float ThresholdStats::estimateLevels(const ImageView &view, int stride, int method, int levels, float thresholds[MAX_LEVELS-1], FrameStats &stats)
+{
+	const ThresholdMethod &m = s_methods[method];
+	int iThresh[MAX_LEVELS-1];
+	int i, n;
+
+	frameStats(view, stride, m.needs | STATS_HISTOGRAM, stats);
+
+	n = otsuLevels(stats.histogram, levels, iThresh);
+	for(i=0; i<levels-1; i++) {
+		if(i < n)
+			thresholds[i] = ((float)iThresh[i])/256;
+		else
+			thresholds[i] = (float)(i+1)/(float)levels;
+	}
+
+	return m.estimate(stats);
+}
+
+//
+// Auto threshold by several methods for one frame
+//
+// "methods" has bit (1 << method) set for each method wanted.
+// One pass makes all of the statistics they need so that
+// comparing methods costs about the same as using one.
+//
+void ThresholdStats::estimateMethods(const ImageView &view, int stride, unsigned int methods, float thresholds[NUM_METHODS], FrameStats &stats)
+{
+	int i, needs;
+
+	needs = 0;
+	for(i=0; i<NUM_METHODS; i++) {
+		if(methods & (1 << i))
+			needs |= s_methods[i].needs;
+	}
+
+	frameStats(view, stride, needs, stats);
+
+	for(i=0; i<NUM_METHODS; i++) {
+		thresholds[i] = 0.0f;
+		if(methods & (1 << i))
+			thresholds[i] = s_methods[i].estimate(stats);
+	}
+}
+
+//
+// requires an RGBA or luminance image
+//
+// Looks at the variance around sampled pixels
+// Pixels are sampled every "stride" lines and columns
+//
+float ThresholdStats::gradient (const ImageView &view, int stride)
+{
+	FrameStats stats;
+
+	frameStats(view, stride, STATS_GRADIENT, stats);
+
+	return GradientMethod(stats);
+
+} // end gradient
+
+
+//
+// Luminance histogram of the pixels sampled every "stride" lines and columns
+//
+void ThresholdStats::histo(const ImageView &view, unsigned int histogram[256], int stride)
+{
+	FrameStats stats;
+
+	frameStats(view, stride, STATS_HISTOGRAM, stats);
+	memcpy((void *)histogram, (const void *)stats.histogram, 256*sizeof(unsigned int));
+}
+
+//
+// Threshold methods
+//
+const ThresholdMethod ThresholdStats::s_methods[NUM_METHODS] = {
+	{ "Gradient", STATS_GRADIENT,  ThresholdStats::GradientMethod },
+	{ "Entropy",  STATS_HISTOGRAM, ThresholdStats::EntropyMethod },
+	{ "Otsu",     STATS_HISTOGRAM, ThresholdStats::OtsuMethod }
+};
+
+// Gradient-weighted mean of the sampled pixels
+float ThresholdStats::GradientMethod(const FrameStats &stats)
+{
+	int t;
+
+	// Calculate the threshold
+	t = (int)((double)stats.sum_exy_fxy/((double)stats.sum_exy + 1.0));
+
+	// 256 levels and RGB pixels or luminance
+	if(stats.bytes == 1)
+		return (float)t/256;
+
+	return (float)t/(3*256);
+}
+
+// Entropy split method
+// http://rsb.info.nih.gov/ij/plugins/download/AutoThresholder.java
+// http://fiji.sc/wiki/index.php/Auto_Threshold#RenyiEntropy
+float ThresholdStats::EntropyMethod(const FrameStats &stats)
+{
+	int iThresh = entropySplit(stats.histogram); // entropy auto threshold
+	return ((float)iThresh)/256;
+}
+
+// Otsu method
+// http://www.labbookpages.co.uk/software/imgProc/otsuThreshold.html
+// http://cis.k.hosei.ac.jp/~wakahara/otsu_th.c
+float ThresholdStats::OtsuMethod(const FrameStats &stats)
+{
+	int iThresh = otsu(stats.samples, stats.histogram);
+	return ((float)iThresh)/256;
+}
+
+
+
+/**
+* Automatic thresholding technique based on the entopy of the histogram.
+* See: P.K. Sahoo, S. Soltani, K.C. Wong and, Y.C. Chen "A Survey of
+* Thresholding Techniques", Computer Vision, Graphics, and Image Processing
+* Vol. 41, pp.233-260, 1988.
+*
+* With bin counts c and C pixels below the split, the black entropy
+*
+*     -sum (c/C)*log(c/C) = log(C) - sum(c*log(c))/C
+*
+* so a running sum of c*log(c) gives the entropy of both sides for all
+* splits in one pass over the histogram.
+*/
+int ThresholdStats::entropySplit(const unsigned int histogram[256])
+{
+	double clogc[256]; // c*log(c) for each bin
+	double total, totalLog;
+	double below, belowLog;
+	double above, aboveLog;
+	double hB, hW;
+	double djMax;
+	double dj;
+	int i, t, tMax;
+
+	total    = 0;
+	totalLog = 0;
+	for(i=0; i<256; i++) {
+		clogc[i]  = CountLog(histogram[i]);
+		total    += (double)histogram[i];
+		totalLog += clogc[i];
+	}
+
+	// This should not normally happen, but...
+	if(total == 0)
+		return 0;
+
+	// Entropy for black and white parts of the histogram
+	below    = 0;
+	belowLog = 0;
+	djMax = 0;
+	tMax  = 0;
+	for(t=0; t<256; t++) {
+
+		below    += (double)histogram[t];
+		belowLog += clogc[t];
+		above     = total - below;
+		aboveLog  = totalLog - belowLog;
+
+		// Black entropy
+		hB = 0;
+		if(below > 0)
+			hB = log(below) - belowLog/below;
+
+		// White entropy
+		hW = 0;
+		if(above > 0)
+			hW = log(above) - aboveLog/above;
+
+		// Histogram index with maximum entropy
+		dj = hB + hW;
+		if(t == 0 || dj > djMax) {
+			djMax = dj;
+			tMax = t;
+		}
+	}
+
+	return tMax;
+}
+
+//
+// c*log(c) for a bin count
+//
+// Counts are small integers for decimated frames so
+// most of them come from a table built once.
+//
+double ThresholdStats::CountLog(unsigned int count)
+{
+	static double table[LOG_TABLE_SIZE];
+	static std::atomic<bool> bTable(false);
+	static std::mutex tableMutex;
+
+	if(count < 2)
+		return 0.0;
+
+	if(count >= LOG_TABLE_SIZE)
+		return (double)count*log((double)count);
+
+	if(!bTable) {
+		std::lock_guard<std::mutex> lock(tableMutex);
+		if(!bTable) {
+			table[0] = 0.0;
+			for(unsigned int i=1; i<LOG_TABLE_SIZE; i++)
+				table[i] = (double)i*log((double)i);
+			bTable = true;
+		}
+	}
+
+	return table[count];
+}
+
+//
+int ThresholdStats::otsu(unsigned int samples, const unsigned int hist[256])
+{
+	unsigned long long n, sum, n0, sum0; // counts and counts times level
+	double d, sigma, den, max_sigma, max_den; // inter-class variance and its divisor
+	int i;
+	int threshold; // threshold for binarization
+
+	if(samples == 0)
+		return 0;
+
+	// The total of the bins, which is less than the samples if some are masked
+	n = 0;
+	sum = 0;
+	for(i = 0; i < 256; i++) {
+		n += hist[i];
+		sum += (unsigned long long)i*hist[i];
+	}
+
+	// sigma maximization
+	// For omega = n0/n and myu = sum0/n the inter-class variance is
+	// (n*sum0 - sum*n0)^2/(n^2*n0*(n - n0)). n^2 is the same for all
+	// and the fractions are compared by multiplying across.
+	threshold = 0;
+	max_sigma = 0.0;
+	max_den = 1.0;
+	n0 = 0;
+	sum0 = 0;
+	for(i = 0; i < 256-1; i++) {
+		n0 += hist[i];
+		sum0 += (unsigned long long)i*hist[i];
+		if(n0 == 0)
+			continue;
+		if(n0 == n)
+			break;
+		d = (double)n*(double)sum0 - (double)sum*(double)n0;
+		sigma = d*d;
+		den = (double)(n0*(n - n0));
+		if(sigma*max_den > max_sigma*den) {
+			max_sigma = sigma;
+			max_den = den;
+			threshold = i;
+		}
+	}
+
+ 	return threshold;
+
+}
+
+// Multi level Otsu
+// The thresholds that divide the histogram into "levels" classes with the
+// greatest inter-class variance. That is the greatest sum over the classes
+// of (counts times level)^2/counts, found for each number of classes ending
+// at each bin from the best with one class less. The search is on LEVEL_BINS
+// bins of the histogram so that it costs about as much as the single level.
+// Returns the number of thresholds, 0-255 in increasing order, or 0 if the
+// histogram is empty.
+int ThresholdStats::otsuLevels(const unsigned int hist[256], int levels, int thresholds[MAX_LEVELS-1])
+{
+	const int scale = 256/LEVEL_BINS;
+	unsigned long long n[LEVEL_BINS+1], sum[LEVEL_BINS+1]; // prefix counts and counts times level
+	double best[MAX_LEVELS][LEVEL_BINS+1]; // best sum of the first k+1 classes ending before bin j
+	int cut[MAX_LEVELS][LEVEL_BINS+1]; // where the last of those classes starts
+	double d, v;
+	int i, j, k, b;
+
+	if(levels < 2 || levels > MAX_LEVELS)
+		return 0;
+
+	n[0] = 0;
+	sum[0] = 0;
+	for(b = 0; b < LEVEL_BINS; b++) {
+		n[b+1] = n[b];
+		sum[b+1] = sum[b];
+		for(i = b*scale; i < (b+1)*scale; i++) {
+			n[b+1] += hist[i];
+			sum[b+1] += (unsigned long long)i*hist[i];
+		}
+	}
+	if(n[LEVEL_BINS] == 0)
+		return 0;
+
+	// One class from the first bin
+	for(j = 1; j <= LEVEL_BINS; j++) {
+		best[0][j] = 0.0;
+		cut[0][j] = 0;
+		if(n[j] > 0) {
+			d = (double)sum[j];
+			best[0][j] = d*d/(double)n[j];
+		}
+	}
+
+	// Another class after the best of one less
+	for(k = 1; k < levels; k++) {
+		for(j = k+1; j <= LEVEL_BINS; j++) {
+			best[k][j] = -1.0;
+			cut[k][j] = k;
+			for(i = k; i < j; i++) {
+				v = best[k-1][i];
+				if(n[j] > n[i]) {
+					d = (double)(sum[j] - sum[i]);
+					v += d*d/(double)(n[j] - n[i]);
+				}
+				if(v > best[k][j]) {
+					best[k][j] = v;
+					cut[k][j] = i;
+				}
+			}
+		}
+	}
+
+	// Back from the last bin, each class starts at a threshold
+	// and the threshold is the last level of the class before
+	j = LEVEL_BINS;
+	for(k = levels-1; k > 0; k--) {
+		j = cut[k][j];
+		thresholds[k-1] = j*scale - 1;
+	}
+
+	return levels-1;
+
+}
@@ -0,0 +1,215 @@
+//
+//		ThresholdStats.h
+//
+//		Statistics of readback frames and the auto threshold methods
+//
+//		Nothing here uses OpenGL so that the estimators can be run and
+//		timed outside a FreeFrame host. A frame is split into bands for
+//		the shared worker pool, or into tiles for incremental statistics.
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#ifndef ThresholdStats_H
+#define ThresholdStats_H
+
+#include <string.h>
+#include <math.h>
+#include "WorkerPool.h"
+
+// CPU instruction sets for the estimators, detected at run time
+#define SIMD_NONE 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+
+// Read-only view of readback pixels
+// The data can be a mapped PBO or a CPU buffer
+struct ImageView {
+	const unsigned char *data;
+	int width;
+	int height;
+	int pitch; // bytes from the start of one line to the next
+	int bytes; // bytes per pixel, 4 for RGBA or 1 for luminance
+	int mask; // 1 if the alpha of RGBA pixels is a mask
+};
+
+// Masked pixels are weighted by alpha for the gradient.
+// Those with alpha below MASK_LEVEL are left out of the histogram.
+#define MASK_LEVEL 128
+
+// Statistics made by a pass over the pixels
+// Levels and percentiles come from the histogram
+#define STATS_GRADIENT    1
+#define STATS_HISTOGRAM   2
+#define STATS_LEVELS      4 // mean, minimum and maximum luminance
+#define STATS_PERCENTILES 8
+
+// Luminance at 5, 25, 50, 75 and 95 percent of the samples
+#define NUM_PERCENTILES 5
+
+// The frame is split into bands of lines for the worker threads
+#define MAX_BANDS 64
+#define MIN_BAND_LINES 16
+
+// Bin counts with c*log(c) in a table for the entropy method
+#define LOG_TABLE_SIZE 4096
+
+// Histogram bins are counted in separate sub-histograms
+// so that neighbouring pixels rarely increment the same bin
+#define NUM_SUBHISTOGRAMS 4
+
+// Partial results for one band of lines
+struct BandStats {
+	long long sum_exy;
+	long long sum_exy_fxy;
+	unsigned int samples; // pixels in the histogram
+	unsigned int histogram[NUM_SUBHISTOGRAMS][256];
+};
+
+// Incremental statistics on a grid of TILE_GRID x TILE_GRID tiles
+// All tiles are counted again every TILE_REFRESH frames
+#define TILE_GRID 8
+#define NUM_TILES (TILE_GRID*TILE_GRID)
+#define TILE_REFRESH 120
+
+// Statistics of one tile and the change at the last update
+struct TileStats {
+	bool valid;
+	bool changed;
+	unsigned long long signature;
+	long long sum_exy;
+	long long sum_exy_fxy;
+	unsigned int samples;
+	unsigned int histogram[256];
+	long long delta_exy;
+	long long delta_exy_fxy;
+	int delta_samples;
+	int delta[256];
+};
+
+// Statistics of a frame for the threshold methods
+struct FrameStats {
+	int width; // size of the frame sampled
+	int height;
+	long long sum_exy; // gradient sums
+	long long sum_exy_fxy;
+	unsigned int samples; // pixels in the histogram
+	unsigned int histogram[256]; // luminance
+	int flags; // statistics that were made
+	int bytes; // bytes per pixel of the frame
+	float mean; // luminance levels 0-255
+	int minimum;
+	int maximum;
+	int percentile[NUM_PERCENTILES];
+};
+
+// Auto threshold method
+// Each method says which statistics it needs so that
+// only those are calculated
+struct ThresholdMethod {
+	const char *name;
+	int needs; // STATS_ flags
+	float (*estimate)(const FrameStats &stats); // threshold 0-1
+};
+
+#define METHOD_GRADIENT 0
+#define METHOD_ENTROPY  1
+#define METHOD_OTSU     2
+#define NUM_METHODS     3
+
+// Output levels of the posterised two tone mode and the
+// coarse histogram that the levels are searched on
+#define MAX_LEVELS 4
+#define LEVEL_BINS 64
+
+class ThresholdStats
+{
+public:
+
+	ThresholdStats();
+	~ThresholdStats();
+
+	// Instruction set of the gradient kernels
+	// The fastest supported is used unless a lower level is set
+	int GetSimdLevel() const { return m_SimdLevel; }
+	void SetSimdLevel(int level);
+	static int CpuSimdLevel();
+
+	// Only count again the tiles that have changed
+	// Set by the thread that runs the estimators
+	bool GetIncremental() const { return m_bIncremental; }
+	void SetIncremental(bool bIncremental);
+
+	// Estimators
+	float estimate(const ImageView &view, int stride, int method, FrameStats &stats);
+	void estimateMethods(const ImageView &view, int stride, unsigned int methods, float thresholds[NUM_METHODS], FrameStats &stats);
+	float estimateLevels(const ImageView &view, int stride, int method, int levels, float thresholds[MAX_LEVELS-1], FrameStats &stats);
+	float gradient (const ImageView &view, int stride = 4);
+	void histo(const ImageView &view, unsigned int histogram[256], int stride = 4);
+	void frameStats(const ImageView &view, int stride, int flags, FrameStats &stats);
+
+	static int entropySplit(const unsigned int histogram[256]);
+	static double CountLog(unsigned int count);
+	static int otsu(unsigned int samples, const unsigned int histogram[256]);
+	static int otsuLevels(const unsigned int histogram[256], int levels, int thresholds[MAX_LEVELS-1]);
+
+	// Luminance 0-255 of an RGBA pixel with the weights of the shaders
+	static unsigned int Luma(const unsigned char *p);
+
+	// Threshold methods
+	static const ThresholdMethod s_methods[NUM_METHODS];
+	static float GradientMethod(const FrameStats &stats);
+	static float EntropyMethod(const FrameStats &stats);
+	static float OtsuMethod(const FrameStats &stats);
+
+private:
+
+	void gradientLine(const unsigned char *linePtr, int pitch, int first, int last, int stride, int bytes, int mask, long long &sum_exy, long long &sum_exy_fxy);
+	void regionStats(const ImageView &view, int stride, int flags, int first, int last, int left, int right, BandStats &band);
+	static void StatsBand(void *data, int band);
+	static void levelStats(int flags, FrameStats &stats);
+	void tileStats(const ImageView &view, int stride, int flags, FrameStats &stats);
+	static void StatsTile(void *data, int tile);
+	static unsigned long long TileSignature(const ImageView &view, int stride, int first, int last, int left, int right);
+
+	// Estimator instruction set (SIMD_NONE, SIMD_SSE2 or SIMD_AVX2)
+	int m_SimdLevel;
+
+	// Threads shared by all instances for the estimators
+	WorkerPool *m_pool;
+	BandStats m_bands[MAX_BANDS];
+	const ImageView *m_bandView;
+	int m_bandStride;
+	int m_bandFlags;
+	int m_bandLines;
+
+	// Incremental statistics
+	bool m_bIncremental;
+	TileStats m_tiles[NUM_TILES];
+	FrameStats m_tileTotal;
+	int m_tileWidth;
+	int m_tileHeight;
+	int m_tileStride;
+	int m_tileFlags;
+	int m_tileBytes;
+	int m_tileMask;
+	int m_tileFrames; // frames since all tiles were counted
+
+};
+
+#endif
@@ -0,0 +1,162 @@
+//
+//		WorkerPool.cpp
+//
+//		Persistent threads shared by all plugin instances in the process
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#include "WorkerPool.h"
+
+// Worker threads are limited so that a pool does not
+// take over a large machine shared with the host
+#define MAX_WORKERS 15
+
+WorkerPool *WorkerPool::s_pool = NULL;
+int WorkerPool::s_refs = 0;
+std::mutex WorkerPool::s_mutex;
+
+WorkerPool *WorkerPool::Acquire()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	if(!s_pool) {
+		// One thread per core including the calling thread
+		int workers = (int)std::thread::hardware_concurrency() - 1;
+		if(workers < 0) workers = 0;
+		if(workers > MAX_WORKERS) workers = MAX_WORKERS;
+		s_pool = new WorkerPool(workers);
+	}
+	s_refs++;
+	return s_pool;
+}
+
+void WorkerPool::Release()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	if(s_refs > 0 && --s_refs == 0) {
+		delete s_pool;
+		s_pool = NULL;
+	}
+}
+
+WorkerPool::WorkerPool(int workers)
+: m_job(NULL),
+  m_data(NULL),
+  m_bands(0),
+  m_next(0),
+  m_remaining(0),
+  m_busy(0),
+  m_generation(0),
+  m_quit(false)
+{
+	for(int i=0; i<workers; i++)
+		m_threads.push_back(std::thread(&WorkerPool::Worker, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_start.notify_all();
+	for(size_t i=0; i<m_threads.size(); i++)
+		m_threads[i].join();
+}
+
+void WorkerPool::Run(JobFunction job, void *data, int bands)
+{
+	int done;
+
+	if(bands <= 0)
+		return;
+
+	// Without workers there is no need to hand over
+	if(m_threads.empty() || bands == 1) {
+		for(int i=0; i<bands; i++)
+			job(data, i);
+		return;
+	}
+
+	std::lock_guard<std::mutex> run(m_runMutex);
+
+	{
+		// Workers still leaving the last job must be out
+		// before the job fields are changed
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this] { return m_busy == 0; });
+		m_job       = job;
+		m_data      = data;
+		m_bands     = bands;
+		m_remaining = bands;
+		m_next      = 0;
+		m_generation++;
+	}
+	m_start.notify_all();
+
+	// The calling thread takes bands as well
+	done = DoBands();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_remaining -= done;
+	m_done.wait(lock, [this] { return m_remaining == 0 && m_busy == 0; });
+}
+
+void WorkerPool::Worker()
+{
+	unsigned int generation = 0;
+	int done;
+
+	for(;;) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start.wait(lock, [&] { return m_quit || m_generation != generation; });
+			if(m_quit)
+				return;
+			generation = m_generation;
+			m_busy++;
+		}
+
+		done = DoBands();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_remaining -= done;
+			m_busy--;
+		}
+		m_done.notify_all();
+	}
+}
+
+// Take bands until there are none left
+// Returns the number of bands done
+int WorkerPool::DoBands()
+{
+	int band;
+	int done = 0;
+
+	for(;;) {
+		band = m_next.fetch_add(1);
+		if(band >= m_bands)
+			break;
+		m_job(m_data, band);
+		done++;
+	}
+
+	return done;
+}
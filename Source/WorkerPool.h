@@ -0,0 +1,83 @@
+//
+//		WorkerPool.h
+//
+//		Persistent threads shared by all plugin instances in the process
+//
+//		A job is split into bands which are taken in turn by the worker
+//		threads and the calling thread. Run returns when all bands are done.
+//
+//		------------------------------------------------------------
+//
+//		Copyright (C) 2015. Lynn Jarvis, Leading Edge. Pty. Ltd.
+//
+//		This program is free software: you can redistribute it and/or modify
+//		it under the terms of the GNU Lesser General Public License as published by
+//		the Free Software Foundation, either version 3 of the License, or
+//		(at your option) any later version.
+//
+//		This program is distributed in the hope that it will be useful,
+//		but WITHOUT ANY WARRANTY; without even the implied warranty of
+//		MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//		GNU Lesser General Public License for more details.
+//
+//		You will receive a copy of the GNU Lesser General Public License along
+//		with this program.  If not, see http://www.gnu.org/licenses/.
+//		--------------------------------------------------------------
+//
+#ifndef WorkerPool_H
+#define WorkerPool_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+class WorkerPool
+{
+public:
+
+	typedef void (*JobFunction)(void *data, int band);
+
+	// The pool is created by the first instance and
+	// deleted when the last one releases it
+	static WorkerPool *Acquire();
+	static void Release();
+
+	// Worker threads plus the calling thread
+	int GetThreadCount() const { return (int)m_threads.size() + 1; }
+
+	// Call job(data, band) for bands 0 to bands-1 and wait
+	// Only one job runs at a time
+	void Run(JobFunction job, void *data, int bands);
+
+private:
+
+	WorkerPool(int workers);
+	~WorkerPool();
+
+	void Worker();
+	int DoBands();
+
+	std::vector<std::thread> m_threads;
+	std::mutex m_runMutex; // one job at a time
+	std::mutex m_mutex;    // job fields and counters
+	std::condition_variable m_start;
+	std::condition_variable m_done;
+
+	JobFunction m_job;
+	void *m_data;
+	int m_bands;
+	std::atomic<int> m_next; // next band to be taken
+	int m_remaining; // bands not finished
+	int m_busy; // workers in DoBands
+	unsigned int m_generation; // changes for each job
+	bool m_quit;
+
+	static WorkerPool *s_pool;
+	static int s_refs;
+	static std::mutex s_mutex;
+
+};
+
+#endif